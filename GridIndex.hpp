@@ -0,0 +1,321 @@
+#ifndef GRIDINDEX_HPP
+#define GRIDINDEX_HPP
+
+
+//
+// GridIndex is a flat uniform grid over the bbox of a static dataset, an alternative to RBush
+// for dense and uniformly spread points, where it answers point and small box queries with
+// no tree descent at all.
+//
+// Item ids are packed per cell in a single CSR array (cellStart gives the range of ids of each
+// cell). An item is registered in every cell its bbox overlaps and reported by a search only
+// from the cell holding the lower left corner of its intersection with the query, so results
+// have no duplicates without any visited set.
+//
+// HybridIndex looks at the distribution of the data when it is loaded and builds a GridIndex
+// or an RBush accordingly, behind the same search API.
+//
+
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "RBush.hpp"
+
+namespace rbush
+{
+  template <class T>
+  class GridIndex
+  {
+    Bbox extent;
+    int cols;
+    int rows;
+    double cellWidth;
+    double cellHeight;
+    std::vector<TreeNode<T> *> items;
+    std::vector<uint32_t> cellStart;
+    std::vector<uint32_t> ids;
+
+
+    int col(double x) const
+    {
+      double c = std::floor((x - this->extent.minX) / this->cellWidth);
+      return std::min(std::max(c, 0.0), this->cols - 1.0);
+    };
+
+    int row(double y) const
+    {
+      double r = std::floor((y - this->extent.minY) / this->cellHeight);
+      return std::min(std::max(r, 0.0), this->rows - 1.0);
+    };
+
+    std::size_t cell(int r, int c) const
+    {
+      return (std::size_t)r * this->cols + c;
+    };
+
+    // cell side giving about ItemsPerCell items per cell, and not smaller than the average item
+    double _cellSize() const
+    {
+      double width = this->extent.maxX - this->extent.minX;
+      double height = this->extent.maxY - this->extent.minY;
+      double n = this->items.size();
+      double size;
+      if (width > 0 && height > 0)
+        size = std::sqrt(width * height * ItemsPerCell / n);
+      else
+        size = std::max(width, height) * ItemsPerCell / n;
+
+      double itemWidth = 0;
+      double itemHeight = 0;
+      for (auto& item: this->items)
+      {
+        itemWidth += item->bbox.maxX - item->bbox.minX;
+        itemHeight += item->bbox.maxY - item->bbox.minY;
+      }
+      return std::max(size, std::max(itemWidth, itemHeight) / n);
+    };
+
+    void _build(double cellSize)
+    {
+      if (!(cellSize > 0))
+        cellSize = this->_cellSize();
+      if (!(cellSize > 0))
+        cellSize = 1;
+
+      // at most a few cells per item, and as many ids in all as a uint32_t can index
+      double maxCells = 4.0 * this->items.size() + 1;
+      double width = this->extent.maxX - this->extent.minX;
+      double height = this->extent.maxY - this->extent.minY;
+      while (std::ceil(width / cellSize) * std::ceil(height / cellSize) > maxCells)
+        cellSize *= 2;
+      for (;;)
+      {
+        this->cols = std::max(1, (int)std::ceil(width / cellSize));
+        this->rows = std::max(1, (int)std::ceil(height / cellSize));
+        this->cellWidth = width > 0 ? width / this->cols : 1;
+        this->cellHeight = height > 0 ? height / this->rows : 1;
+
+        uint64_t total = 0;
+        for (auto& item: this->items)
+          total += (uint64_t)(row(item->bbox.maxY) - row(item->bbox.minY) + 1) *
+                   (col(item->bbox.maxX) - col(item->bbox.minX) + 1);
+        if (total <= std::numeric_limits<uint32_t>::max())
+          break;
+        cellSize *= 2;
+      }
+
+      // count the ids of each cell, then place them
+      this->cellStart.assign((std::size_t)this->cols * this->rows + 1, 0);
+      for (auto& item: this->items)
+        for (int r = row(item->bbox.minY); r <= row(item->bbox.maxY); r++)
+          for (int c = col(item->bbox.minX); c <= col(item->bbox.maxX); c++)
+            this->cellStart[this->cell(r, c) + 1]++;
+      for (std::size_t i = 1; i < this->cellStart.size(); i++)
+        this->cellStart[i] += this->cellStart[i - 1];
+
+      this->ids.resize(this->cellStart.back());
+      std::vector<uint32_t> next(this->cellStart.begin(), this->cellStart.end() - 1);
+      for (uint32_t i = 0; i < this->items.size(); i++)
+      {
+        auto& bbox = this->items[i]->bbox;
+        for (int r = row(bbox.minY); r <= row(bbox.maxY); r++)
+          for (int c = col(bbox.minX); c <= col(bbox.maxX); c++)
+            this->ids[next[this->cell(r, c)]++] = i;
+      }
+    };
+
+  public:
+
+    // target average number of items per cell when the cell size is chosen from density
+    static const int ItemsPerCell = 4;
+
+    // cellSize <= 0 chooses the cell size from the density of the data
+    GridIndex(const std::vector<TreeNode<T> *>& data, double cellSize = 0): items(data)
+    {
+      this->extent = emptyBbox();
+      for (auto& item: this->items)
+        bboxExtend(this->extent, item->bbox);
+      if (this->items.empty())
+      {
+        this->extent = { 0, 0, 0, 0 };
+        this->cols = this->rows = 1;
+        this->cellWidth = this->cellHeight = 1;
+        this->cellStart.assign(2, 0);
+        return;
+      }
+      this->_build(cellSize);
+    };
+
+    const Bbox& bbox() const { return this->extent; };
+    int columns() const { return this->cols; };
+    int rowCount() const { return this->rows; };
+    std::size_t size() const { return this->items.size(); };
+
+    // visit the items intersecting bbox; stops as soon as visitor returns false
+    template <class Visitor>
+    void search(const Bbox& bbox, Visitor visitor) const
+    {
+      if (this->items.empty() || !bboxIntersects(bbox, this->extent))
+        return;
+
+      int c0 = col(bbox.minX), c1 = col(bbox.maxX);
+      int r0 = row(bbox.minY), r1 = row(bbox.maxY);
+      for (int r = r0; r <= r1; r++)
+      {
+        for (int c = c0; c <= c1; c++)
+        {
+          auto cell = this->cell(r, c);
+          for (auto i = this->cellStart[cell]; i < this->cellStart[cell + 1]; i++)
+          {
+            auto item = this->items[this->ids[i]];
+            auto& b = item->bbox;
+            if (!bboxIntersects(bbox, b))
+              continue;
+            // report the item from one cell only
+            if (col(std::max(b.minX, bbox.minX)) != c || row(std::max(b.minY, bbox.minY)) != r)
+              continue;
+            if (!visitor(item))
+              return;
+          }
+        }
+      }
+    };
+
+    std::vector<TreeNode<T> *> *search(const Bbox& bbox) const
+    {
+      auto result = new std::vector<TreeNode<T> *>();
+      this->search(bbox, [result](TreeNode<T> *item) { result->push_back(item); return true; });
+      return result;
+    };
+
+    std::vector<TreeNode<T> *> *all() const
+    {
+      return new std::vector<TreeNode<T> *>(this->items);
+    };
+  };
+
+
+  // distribution statistics of a dataset, used by HybridIndex to choose its index
+  struct DataStats
+  {
+    std::size_t count;
+    double pointFraction;   // fraction of items with an empty bbox
+    double occupancyCv;     // coefficient of variation of the number of item centers per cell
+                            // of a coarse histogram: about 0.25 for uniform data, much more for clustered data
+  };
+
+  template <class T>
+  DataStats dataStats(const std::vector<TreeNode<T> *>& data)
+  {
+    DataStats stats = { data.size(), 0, 0 };
+    if (data.empty())
+      return stats;
+
+    Bbox extent = emptyBbox();
+    std::size_t points = 0;
+    for (auto& item: data)
+    {
+      auto& b = item->bbox;
+      bboxExtend(extent, b);
+      if (b.minX == b.maxX && b.minY == b.maxY)
+        points++;
+    }
+    stats.pointFraction = (double)points / data.size();
+
+    // histogram of about 16 items per cell
+    int side = std::max(1, (int)std::sqrt(data.size() / 16.0));
+    double width = std::max(extent.maxX - extent.minX, std::numeric_limits<double>::min());
+    double height = std::max(extent.maxY - extent.minY, std::numeric_limits<double>::min());
+    std::vector<uint32_t> histogram(side * side, 0);
+    for (auto& item: data)
+    {
+      auto& b = item->bbox;
+      int c = std::min(side - 1, (int)(((b.minX + b.maxX) / 2 - extent.minX) / width * side));
+      int r = std::min(side - 1, (int)(((b.minY + b.maxY) / 2 - extent.minY) / height * side));
+      histogram[r * side + c]++;
+    }
+    double mean = (double)data.size() / histogram.size();
+    double variance = 0;
+    for (auto count: histogram)
+      variance += (count - mean) * (count - mean);
+    variance /= histogram.size();
+    stats.occupancyCv = std::sqrt(variance) / mean;
+    return stats;
+  }
+
+
+  // a GridIndex for large, uniformly spread point datasets, an RBush otherwise
+  template <class T>
+  class HybridIndex
+  {
+    DataStats _stats;
+    GridIndex<T> *grid;
+    RBush<T> *tree;
+
+  public:
+
+    static const std::size_t MinGridItems = 1024;
+
+    // only for points: an item with an extent is registered in every cell it overlaps, and a few
+    // large ones would fill the grid
+    static bool preferGrid(const DataStats& stats)
+    {
+      return stats.count >= MinGridItems && stats.count <= std::numeric_limits<uint32_t>::max() &&
+             stats.pointFraction == 1 && stats.occupancyCv <= 0.5;
+    };
+
+    HybridIndex(std::vector<TreeNode<T> *>& data): grid(NULL), tree(NULL)
+    {
+      this->_stats = dataStats(data);
+      if (preferGrid(this->_stats))
+        this->grid = new GridIndex<T>(data);
+      else
+        this->tree = new RBush<T>(data);
+    };
+
+    HybridIndex(const HybridIndex&) = delete;
+    HybridIndex& operator=(const HybridIndex&) = delete;
+
+    ~HybridIndex()
+    {
+      delete this->grid;
+      delete this->tree;
+    };
+
+    const DataStats& stats() const { return this->_stats; };
+    bool usesGrid() const { return this->grid != NULL; };
+
+    template <class Visitor>
+    void search(const Bbox& bbox, Visitor visitor)
+    {
+      if (this->grid)
+        this->grid->search(bbox, visitor);
+      else
+        this->tree->search(bbox, visitor);
+    };
+
+    std::vector<TreeNode<T> *> *search(const Bbox& bbox)
+    {
+      return this->grid ? this->grid->search(bbox) : this->tree->search(bbox);
+    };
+
+    std::vector<TreeNode<T> *> *all()
+    {
+      return this->grid ? this->grid->all() : this->tree->all();
+    };
+  };
+
+  template <class T>
+  const int GridIndex<T>::ItemsPerCell;
+
+  template <class T>
+  const std::size_t HybridIndex<T>::MinGridItems;
+
+}
+
+
+#endif // GRIDINDEX_HPP
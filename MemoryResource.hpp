@@ -0,0 +1,251 @@
+#ifndef MEMORYRESOURCE_HPP
+#define MEMORYRESOURCE_HPP
+
+
+//
+// Polymorphic memory resources used by RBush for its nodes, child arrays and insertion paths.
+//
+// With C++17 these are the std::pmr types. For C++11 builds, rbush::pmr provides the subset
+// of <memory_resource> RBush needs, with the same names and semantics: memory_resource,
+// polymorphic_allocator, new_delete_resource(), monotonic_buffer_resource and
+// unsynchronized_pool_resource.
+//
+
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+namespace rbush
+{
+  namespace pmr
+  {
+#if __cplusplus >= 201703L
+
+    using std::pmr::memory_resource;
+    using std::pmr::polymorphic_allocator;
+    using std::pmr::new_delete_resource;
+    using std::pmr::get_default_resource;
+    using std::pmr::monotonic_buffer_resource;
+    using std::pmr::unsynchronized_pool_resource;
+
+#else
+
+    class memory_resource
+    {
+      static constexpr std::size_t max_align = alignof(std::max_align_t);
+
+    public:
+      virtual ~memory_resource() {};
+
+      void *allocate(std::size_t bytes, std::size_t alignment = max_align) { return do_allocate(bytes, alignment); };
+      void deallocate(void *p, std::size_t bytes, std::size_t alignment = max_align) { do_deallocate(p, bytes, alignment); };
+      bool is_equal(const memory_resource& other) const { return do_is_equal(other); };
+
+    private:
+      virtual void *do_allocate(std::size_t bytes, std::size_t alignment) = 0;
+      virtual void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) = 0;
+      virtual bool do_is_equal(const memory_resource& other) const = 0;
+    };
+
+    inline bool operator==(const memory_resource& a, const memory_resource& b) { return &a == &b || a.is_equal(b); }
+    inline bool operator!=(const memory_resource& a, const memory_resource& b) { return !(a == b); }
+
+    class new_delete_memory_resource: public memory_resource
+    {
+      void *do_allocate(std::size_t bytes, std::size_t) { return ::operator new(bytes); };
+      void do_deallocate(void *p, std::size_t, std::size_t) { ::operator delete(p); };
+      bool do_is_equal(const memory_resource& other) const { return this == &other; };
+    };
+
+    inline memory_resource *new_delete_resource()
+    {
+      static new_delete_memory_resource resource;
+      return &resource;
+    }
+
+    inline memory_resource *get_default_resource()
+    {
+      return new_delete_resource();
+    }
+
+    template <class T>
+    class polymorphic_allocator
+    {
+      memory_resource *_resource;
+
+      template <class U>
+      friend class polymorphic_allocator;
+
+    public:
+      typedef T value_type;
+
+      polymorphic_allocator(): _resource(get_default_resource()) {};
+      polymorphic_allocator(memory_resource *resource): _resource(resource) {};
+      template <class U>
+      polymorphic_allocator(const polymorphic_allocator<U>& other): _resource(other._resource) {};
+
+      T *allocate(std::size_t n) { return static_cast<T *>(_resource->allocate(n * sizeof(T), alignof(T))); };
+      void deallocate(T *p, std::size_t n) { _resource->deallocate(p, n * sizeof(T), alignof(T)); };
+
+      memory_resource *resource() const { return _resource; };
+
+      // containers copied from a pmr container use the default resource, as with std::pmr
+      polymorphic_allocator select_on_container_copy_construction() const { return polymorphic_allocator(); };
+    };
+
+    template <class T, class U>
+    bool operator==(const polymorphic_allocator<T>& a, const polymorphic_allocator<U>& b) { return *a.resource() == *b.resource(); }
+    template <class T, class U>
+    bool operator!=(const polymorphic_allocator<T>& a, const polymorphic_allocator<U>& b) { return !(a == b); }
+
+    // hands out memory from chunks of geometrically increasing size; deallocate is a no-op and
+    // everything is given back at once by release() or by the destructor
+    class monotonic_buffer_resource: public memory_resource
+    {
+      memory_resource *upstream;
+      std::vector<std::pair<void *, std::size_t>> chunks;
+      char *current;
+      std::size_t available;
+      std::size_t nextSize;
+
+      void *do_allocate(std::size_t bytes, std::size_t alignment)
+      {
+        auto padding = (alignment - (std::size_t)current % alignment) % alignment;
+        if (!current || padding + bytes > available)
+        {
+          auto size = std::max(nextSize, bytes + alignment);
+          current = static_cast<char *>(upstream->allocate(size));
+          chunks.push_back(std::make_pair((void *)current, size));
+          available = size;
+          nextSize = size * 2;
+          padding = (alignment - (std::size_t)current % alignment) % alignment;
+        }
+        auto p = current + padding;
+        current = p + bytes;
+        available -= padding + bytes;
+        return p;
+      };
+
+      void do_deallocate(void *, std::size_t, std::size_t) {};
+      bool do_is_equal(const memory_resource& other) const { return this == &other; };
+
+    public:
+      explicit monotonic_buffer_resource(std::size_t initialSize = 1024, memory_resource *upstream = get_default_resource())
+        : upstream(upstream), current(NULL), available(0), nextSize(std::max<std::size_t>(initialSize, 64)) {};
+      explicit monotonic_buffer_resource(memory_resource *upstream)
+        : upstream(upstream), current(NULL), available(0), nextSize(1024) {};
+      monotonic_buffer_resource(const monotonic_buffer_resource&) = delete;
+      monotonic_buffer_resource& operator=(const monotonic_buffer_resource&) = delete;
+      ~monotonic_buffer_resource() { release(); };
+
+      void release()
+      {
+        for (auto& chunk: chunks)
+          upstream->deallocate(chunk.first, chunk.second);
+        chunks.clear();
+        current = NULL;
+        available = 0;
+      };
+
+      memory_resource *upstream_resource() const { return upstream; };
+    };
+
+    // free lists of blocks of power of two sizes up to 4 KB carved out of chunks from upstream;
+    // bigger or over-aligned blocks go straight to upstream. Not thread-safe, like its std counterpart.
+    class unsynchronized_pool_resource: public memory_resource
+    {
+      static const int Pools = 9;               // 16 bytes to 4 KB
+      static const std::size_t MinBlock = 16;
+      static const std::size_t ChunkSize = 64 * 1024;
+
+      struct FreeBlock
+      {
+        FreeBlock *next;
+      };
+
+      memory_resource *upstream;
+      FreeBlock *freeLists[Pools];
+      std::vector<std::pair<void *, std::size_t>> chunks;
+
+      static int pool(std::size_t bytes, std::size_t alignment)
+      {
+        if (alignment > alignof(std::max_align_t))
+          return -1;
+        int i = 0;
+        for (std::size_t block = MinBlock; block < bytes; block *= 2)
+          i++;
+        return i < Pools ? i : -1;
+      };
+
+      void *do_allocate(std::size_t bytes, std::size_t alignment)
+      {
+        auto i = pool(bytes, alignment);
+        if (i < 0)
+          return upstream->allocate(bytes, alignment);
+        if (!freeLists[i])
+        {
+          // carve a new chunk into blocks of that pool
+          std::size_t block = MinBlock << i;
+          std::size_t size = ChunkSize;
+          auto chunk = static_cast<char *>(upstream->allocate(size));
+          chunks.push_back(std::make_pair((void *)chunk, size));
+          for (auto p = chunk; p + block <= chunk + size; p += block)
+          {
+            auto free = reinterpret_cast<FreeBlock *>(p);
+            free->next = freeLists[i];
+            freeLists[i] = free;
+          }
+        }
+        auto block = freeLists[i];
+        freeLists[i] = block->next;
+        return block;
+      };
+
+      void do_deallocate(void *p, std::size_t bytes, std::size_t alignment)
+      {
+        auto i = pool(bytes, alignment);
+        if (i < 0)
+        {
+          upstream->deallocate(p, bytes, alignment);
+          return;
+        }
+        auto block = static_cast<FreeBlock *>(p);
+        block->next = freeLists[i];
+        freeLists[i] = block;
+      };
+
+      bool do_is_equal(const memory_resource& other) const { return this == &other; };
+
+    public:
+      explicit unsynchronized_pool_resource(memory_resource *upstream = get_default_resource()): upstream(upstream)
+      {
+        std::fill(freeLists, freeLists + Pools, (FreeBlock *)NULL);
+      };
+      unsynchronized_pool_resource(const unsynchronized_pool_resource&) = delete;
+      unsynchronized_pool_resource& operator=(const unsynchronized_pool_resource&) = delete;
+      ~unsynchronized_pool_resource() { release(); };
+
+      // gives back the pooled chunks; blocks bigger than the largest pool must have been deallocated
+      void release()
+      {
+        for (auto& chunk: chunks)
+          upstream->deallocate(chunk.first, chunk.second);
+        chunks.clear();
+        std::fill(freeLists, freeLists + Pools, (FreeBlock *)NULL);
+      };
+
+      memory_resource *upstream_resource() const { return upstream; };
+    };
+
+#endif
+  }
+}
+
+
+#endif // MEMORYRESOURCE_HPP
@@ -0,0 +1,620 @@
+#ifndef PAGEDRBUSH_HPP
+#define PAGEDRBUSH_HPP
+
+
+//
+// PagedRBush is an out-of-core variant of RBush for static datasets bigger than memory.
+//
+// Each node is a fixed-size page of a file: a small header followed by an array of entries,
+// (bbox, payload) in leaves and (bbox, child page) in internal nodes. Page 0 holds the file
+// header.
+//
+// The tree is bulk loaded bottom-up with Sort-Tile-Recursive from a stream of items, so the
+// dataset never has to fit in memory. The items are sorted along x with an external merge sort
+// in temporary files; each slice of about sqrt(N * M) consecutive items is sorted along y (in
+// memory, or externally when it is too big) and packed into leaves of M items. The entries of
+// the leaves, sorted along x, make the next level, and so on up to the root. Pages are written
+// sequentially, level by level, the root last.
+//
+// As with the searches of RBush returning NULL, errors are not exceptions: create() and open()
+// return NULL when the file can't be created, written or read, and searches report read errors
+// through their result.
+//
+// Searches read pages through a BufferPool, a fixed number of page frames in memory recycled
+// with the CLOCK policy, which counts its hits and misses.
+//
+// Payloads are copied to the file as is and must be trivially copyable (ids, offsets).
+//
+// Item indices and file offsets are 64-bit, so files are not limited to 2 GB or 2^31 items;
+// on 32-bit platforms, build with -D_FILE_OFFSET_BITS=64 for a 64-bit off_t.
+//
+
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <type_traits>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+#include "RBush.hpp"
+
+namespace rbush
+{
+  // seek to the start of a page with a 64-bit offset (fseek takes a long, 32-bit on some platforms)
+  inline bool seekPage(std::FILE *file, uint64_t page, std::size_t pageSize)
+  {
+    uint64_t offset = page * pageSize;
+#ifdef _WIN32
+    if (offset / pageSize != page || offset > (uint64_t)std::numeric_limits<__int64>::max())
+      return false;
+    return !_fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    if (offset / pageSize != page || offset > (uint64_t)std::numeric_limits<off_t>::max())
+      return false;
+    return !fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+  }
+
+  // fixed number of page frames over a file of fixed-size pages, recycled with the CLOCK policy
+  class BufferPool
+  {
+    std::FILE *file;
+    std::size_t pageSize;
+    std::vector<char *> frames;
+    std::vector<uint64_t> framePages;
+    std::vector<bool> referenced;
+    std::unordered_map<uint64_t, std::size_t> pageFrames;
+    std::size_t hand;
+    std::size_t used;
+    uint64_t _hits;
+    uint64_t _misses;
+
+    std::size_t _victim()
+    {
+      if (this->used < this->frames.size())
+        return this->used++;
+      // second chance: skip and clear the frames referenced since the hand last passed
+      while (this->referenced[this->hand])
+      {
+        this->referenced[this->hand] = false;
+        this->hand = (this->hand + 1) % this->frames.size();
+      }
+      auto frame = this->hand;
+      this->hand = (this->hand + 1) % this->frames.size();
+      this->pageFrames.erase(this->framePages[frame]);
+      return frame;
+    };
+
+  public:
+    BufferPool(std::FILE *file, std::size_t pageSize, std::size_t capacity)
+      : file(file), pageSize(pageSize), hand(0), used(0), _hits(0), _misses(0)
+    {
+      capacity = std::max<std::size_t>(capacity, 1);
+      for (std::size_t i = 0; i < capacity; i++)
+        this->frames.push_back(static_cast<char *>(::operator new(pageSize)));
+      this->framePages.resize(capacity);
+      this->referenced.resize(capacity, false);
+    };
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool()
+    {
+      for (auto frame: this->frames)
+        ::operator delete(frame);
+    };
+
+    // content of page, valid until the next call; NULL if it can't be read
+    const char *page(uint64_t page)
+    {
+      auto found = this->pageFrames.find(page);
+      if (found != this->pageFrames.end())
+      {
+        this->_hits++;
+        this->referenced[found->second] = true;
+        return this->frames[found->second];
+      }
+
+      this->_misses++;
+      if (!seekPage(this->file, page, this->pageSize))
+        return NULL;
+      auto frame = this->_victim();
+      if (std::fread(this->frames[frame], this->pageSize, 1, this->file) != 1)
+      {
+        // the frame is free again, holding a page that can't be mapped
+        this->referenced[frame] = false;
+        this->framePages[frame] = std::numeric_limits<uint64_t>::max();
+        return NULL;
+      }
+      this->framePages[frame] = page;
+      this->referenced[frame] = true;
+      this->pageFrames[page] = frame;
+      return this->frames[frame];
+    };
+
+    std::size_t capacity() const { return this->frames.size(); };
+    uint64_t hits() const { return this->_hits; };
+    uint64_t misses() const { return this->_misses; };
+    void resetCounters() { this->_hits = this->_misses = 0; };
+  };
+
+
+  template <class T>
+  class PagedRBush
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "PagedRBush payloads are written to disk as is");
+
+  public:
+    struct Item
+    {
+      Bbox bbox;
+      T data;
+    };
+
+  private:
+    static const uint64_t Magic = 0x3168737562727066ULL; // "fprbush1"
+
+    struct Header
+    {
+      uint64_t magic;
+      uint64_t pageSize;
+      uint64_t root;
+      uint64_t count;
+      uint64_t payloadSize;
+    };
+
+    // header of a node page, followed by its entries
+    struct NodeHeader
+    {
+      uint32_t count;
+      uint32_t leaf;
+      uint64_t padding;
+    };
+
+    struct ChildEntry
+    {
+      Bbox bbox;
+      uint64_t page;
+    };
+
+    // runs merged at once by the external sort
+    static const std::size_t MaxFanIn = 64;
+
+    std::FILE *file;
+    std::size_t _pageSize;
+    uint64_t rootPage;
+    uint64_t _count;
+    BufferPool *pool;
+
+    // build state
+    std::vector<char> buffer;
+    uint64_t nextPage;
+    std::size_t memoryItems;
+
+
+    PagedRBush(std::FILE *file)
+      : file(file), _pageSize(0), rootPage(0), _count(0), pool(NULL), nextPage(1), memoryItems(0)
+    {
+    };
+
+    static std::size_t capacity(std::size_t pageSize)
+    {
+      auto entry = std::max(sizeof(Item), sizeof(ChildEntry));
+      return (pageSize - sizeof(NodeHeader)) / entry;
+    };
+
+    template <class R>
+    static bool lessX(const R& a, const R& b)
+    {
+      return a.bbox.minX < b.bbox.minX;
+    };
+
+    template <class R>
+    static bool lessY(const R& a, const R& b)
+    {
+      return a.bbox.minY < b.bbox.minY;
+    };
+
+    static void close(std::FILE *file)
+    {
+      if (file)
+        std::fclose(file);
+    };
+
+    bool _write(uint64_t page, const void *data, std::size_t size)
+    {
+      return seekPage(this->file, page, this->_pageSize) &&
+             std::fwrite(data, size, 1, this->file) == 1;
+    };
+
+    // write the node held in buffer as the next page
+    bool _writeNode(uint32_t count, bool leaf, uint64_t& page)
+    {
+      NodeHeader header = { count, leaf, 0 };
+      std::memcpy(this->buffer.data(), &header, sizeof(header));
+      page = this->nextPage++;
+      bool written = this->_write(page, this->buffer.data(), this->_pageSize);
+      std::fill(this->buffer.begin(), this->buffer.end(), 0);
+      return written;
+    };
+
+    // merge the sorted runs [first, last) into a new temporary file, or NULL
+    template <class R, class Less>
+    static std::FILE *_merge(std::FILE **first, std::FILE **last, Less less)
+    {
+      struct Head
+      {
+        R record;
+        std::size_t run;
+      };
+      auto greater = [&less](const Head& a, const Head& b) { return less(b.record, a.record); };
+      std::priority_queue<Head, std::vector<Head>, decltype(greater)> heads(greater);
+
+      auto merged = std::tmpfile();
+      if (!merged)
+        return NULL;
+      Head head;
+      for (head.run = 0; first + head.run != last; head.run++)
+      {
+        std::rewind(first[head.run]);
+        if (std::fread(&head.record, sizeof(R), 1, first[head.run]) == 1)
+          heads.push(head);
+      }
+      while (!heads.empty())
+      {
+        head = heads.top();
+        heads.pop();
+        if (std::fwrite(&head.record, sizeof(R), 1, merged) != 1)
+          break;
+        if (std::fread(&head.record, sizeof(R), 1, first[head.run]) == 1)
+          heads.push(head);
+      }
+
+      bool failed = !heads.empty();
+      for (auto run = first; run != last; run++)
+        failed = failed || std::ferror(*run);
+      if (failed)
+      {
+        std::fclose(merged);
+        return NULL;
+      }
+      return merged;
+    };
+
+    // sort the records given by next(record), which returns false after the last one, into a
+    // rewound temporary file and set count; runs of memoryItems records are sorted in memory,
+    // then merged MaxFanIn at a time. Returns NULL on error
+    template <class R, class Next, class Less>
+    std::FILE *_sort(Next next, Less less, uint64_t& count)
+    {
+      std::vector<std::FILE *> runs;
+      std::vector<R> run;
+      R record;
+      bool more = true;
+      bool failed = false;
+      count = 0;
+      while (more && !failed)
+      {
+        run.clear();
+        while (run.size() < this->memoryItems && (more = next(record)))
+          run.push_back(record);
+        if (run.empty() && !runs.empty())
+          break;
+
+        std::sort(run.begin(), run.end(), less);
+        count += run.size();
+        auto file = std::tmpfile();
+        if (file)
+          runs.push_back(file);
+        failed = !file || (!run.empty() && std::fwrite(run.data(), sizeof(R), run.size(), file) != run.size());
+      }
+
+      while (runs.size() > 1 && !failed)
+      {
+        std::vector<std::FILE *> merged;
+        for (std::size_t i = 0; i < runs.size() && !failed; i += MaxFanIn)
+        {
+          auto file = _merge<R>(runs.data() + i, runs.data() + std::min(i + MaxFanIn, runs.size()), less);
+          if (file)
+            merged.push_back(file);
+          failed = !file;
+        }
+        for (auto file: runs)
+          std::fclose(file);
+        runs.swap(merged);
+      }
+
+      if (failed || std::fflush(runs[0]))
+      {
+        for (auto file: runs)
+          std::fclose(file);
+        return NULL;
+      }
+      std::rewind(runs[0]);
+      return runs[0];
+    };
+
+    // write count records as the next node and set the entry of its parent
+    template <class R>
+    bool _pack(const R *records, std::size_t count, ChildEntry& entry)
+    {
+      entry.bbox = emptyBbox();
+      auto entries = this->buffer.data() + sizeof(NodeHeader);
+      for (std::size_t i = 0; i < count; i++)
+      {
+        std::memcpy(entries + i * sizeof(R), &records[i], sizeof(R));
+        bboxExtend(entry.bbox, records[i].bbox);
+      }
+      return this->_writeNode(count, std::is_same<R, Item>::value, entry.page);
+    };
+
+    // write the nodes of the level holding the count records of sorted, in x order, and set
+    // nodes; returns a rewound temporary file of their entries, or NULL
+    template <class R>
+    std::FILE *_level(std::FILE *sorted, uint64_t count, uint64_t& nodes)
+    {
+      std::size_t M = capacity(this->_pageSize);
+
+      // cut the level into vertical slices of about sqrt(count / M) nodes
+      uint64_t slice = M * (uint64_t)std::ceil(std::sqrt(std::ceil(count / (double)M)));
+
+      auto parents = std::tmpfile();
+      bool failed = !parents;
+      std::vector<R> records;
+      nodes = 0;
+      for (uint64_t left = 0; left < count && !failed; left += slice)
+      {
+        uint64_t n = std::min(slice, count - left);
+
+        // sort the slice along y, externally when it doesn't fit in memory
+        std::FILE *ordered = NULL;
+        if (n <= this->memoryItems)
+        {
+          records.resize(n);
+          failed = std::fread(records.data(), sizeof(R), n, sorted) != n;
+          std::sort(records.begin(), records.end(), lessY<R>);
+        }
+        else
+        {
+          uint64_t read = 0;
+          uint64_t sortedCount = 0;
+          ordered = this->_sort<R>([sorted, n, &read](R& record) -> bool
+          {
+            return read < n && std::fread(&record, sizeof(R), 1, sorted) == 1 && ++read;
+          }, lessY<R>, sortedCount);
+          failed = !ordered || sortedCount != n;
+        }
+
+        for (uint64_t i = 0; i < n && !failed; i += M)
+        {
+          std::size_t k = std::min<uint64_t>(M, n - i);
+          const R *chunk = records.data() + i;
+          if (ordered)
+          {
+            records.resize(k);
+            chunk = records.data();
+            failed = std::fread(records.data(), sizeof(R), k, ordered) != k;
+          }
+
+          ChildEntry entry;
+          failed = failed || !this->_pack(chunk, k, entry) ||
+                   std::fwrite(&entry, sizeof(entry), 1, parents) != 1;
+          nodes++;
+        }
+        close(ordered);
+      }
+
+      if (failed || std::fflush(parents))
+      {
+        close(parents);
+        return NULL;
+      }
+      std::rewind(parents);
+      return parents;
+    };
+
+    // write the tree of the count items of sorted, in x order, level by level up to the root
+    bool _build(std::FILE *sorted, uint64_t count)
+    {
+      if (!count)
+        return this->_writeNode(0, true, this->rootPage);
+
+      uint64_t nodes = 0;
+      auto level = this->_level<Item>(sorted, count, nodes);
+      while (level && nodes > 1)
+      {
+        // the entries of a level, sorted along x, make the next one
+        uint64_t read = 0;
+        uint64_t sortedCount = 0;
+        auto entries = this->_sort<ChildEntry>([level, nodes, &read](ChildEntry& entry) -> bool
+        {
+          return read < nodes && std::fread(&entry, sizeof(entry), 1, level) == 1 && ++read;
+        }, lessX<ChildEntry>, sortedCount);
+        std::fclose(level);
+        level = NULL;
+        if (entries && sortedCount == nodes)
+          level = this->_level<ChildEntry>(entries, sortedCount, nodes);
+        close(entries);
+      }
+      if (!level)
+        return false;
+      std::fclose(level);
+
+      // the root is the last page written
+      this->rootPage = this->nextPage - 1;
+      return true;
+    };
+
+    bool _open(std::size_t cachePages)
+    {
+      Header header;
+      if (std::fseek(this->file, 0, SEEK_SET) || std::fread(&header, sizeof(header), 1, this->file) != 1 ||
+          header.magic != Magic || header.payloadSize != sizeof(T) || header.pageSize < sizeof(Header))
+        return false;
+      this->_pageSize = header.pageSize;
+      this->rootPage = header.root;
+      this->_count = header.count;
+      this->pool = new BufferPool(this->file, this->_pageSize, cachePages);
+      return true;
+    };
+
+  public:
+
+    // bulk load the items given by source(item), which returns false after the last one, into a
+    // new file of pages of pageSize bytes, then serve it through a buffer pool of cachePages pages;
+    // the build holds at most about memoryItems items in memory. Returns NULL on error
+    template <class Source>
+    static PagedRBush *create(const std::string& path, Source source, std::size_t pageSize = 4096,
+                              std::size_t cachePages = 1024, std::size_t memoryItems = 1 << 20)
+    {
+      pageSize = std::max(pageSize, sizeof(Header));
+      if (capacity(pageSize) < 4)
+        return NULL;
+      auto file = std::fopen(path.c_str(), "w+b");
+      if (!file)
+        return NULL;
+
+      auto tree = new PagedRBush(file);
+      tree->_pageSize = pageSize;
+      tree->memoryItems = std::max(memoryItems, capacity(pageSize));
+      tree->buffer.assign(pageSize, 0);
+
+      uint64_t count = 0;
+      auto sorted = tree->template _sort<Item>(source, lessX<Item>, count);
+      bool built = sorted && tree->_build(sorted, count);
+      close(sorted);
+      if (built)
+      {
+        Header header = { Magic, pageSize, tree->rootPage, count, sizeof(T) };
+        std::memcpy(tree->buffer.data(), &header, sizeof(header));
+        built = tree->_write(0, tree->buffer.data(), pageSize) && !std::fflush(file);
+      }
+      tree->buffer.clear();
+      tree->buffer.shrink_to_fit();
+
+      if (!built || !tree->_open(cachePages))
+      {
+        delete tree;
+        std::remove(path.c_str());
+        return NULL;
+      }
+      return tree;
+    };
+
+    // bulk load data, as above
+    static PagedRBush *create(const std::string& path, const std::vector<Item>& data, std::size_t pageSize = 4096,
+                              std::size_t cachePages = 1024)
+    {
+      std::size_t i = 0;
+      return create(path, [&data, &i](Item& item) -> bool
+      {
+        if (i == data.size())
+          return false;
+        item = data[i++];
+        return true;
+      }, pageSize, cachePages);
+    };
+
+    // open a file written by create(), or NULL
+    static PagedRBush *open(const std::string& path, std::size_t cachePages = 1024)
+    {
+      auto file = std::fopen(path.c_str(), "rb");
+      if (!file)
+        return NULL;
+      auto tree = new PagedRBush(file);
+      if (!tree->_open(cachePages))
+      {
+        delete tree;
+        return NULL;
+      }
+      return tree;
+    };
+
+    PagedRBush(const PagedRBush&) = delete;
+    PagedRBush& operator=(const PagedRBush&) = delete;
+
+    ~PagedRBush()
+    {
+      delete this->pool;
+      std::fclose(this->file);
+    };
+
+    std::size_t size() const { return this->_count; };
+    std::size_t pageSize() const { return this->_pageSize; };
+    const BufferPool& bufferPool() const { return *this->pool; };
+    uint64_t hits() const { return this->pool->hits(); };
+    uint64_t misses() const { return this->pool->misses(); };
+    void resetCounters() { this->pool->resetCounters(); };
+
+    // visit the items intersecting bbox; stops as soon as visitor(itemBbox, data) returns false.
+    // Returns false if a page can't be read
+    template <class Visitor>
+    bool search(const Bbox& bbox, Visitor visitor)
+    {
+      std::vector<uint64_t> nodesToSearch;
+      nodesToSearch.push_back(this->rootPage);
+      while (!nodesToSearch.empty())
+      {
+        auto page = this->pool->page(nodesToSearch.back());
+        nodesToSearch.pop_back();
+        if (!page)
+          return false;
+
+        NodeHeader header;
+        std::memcpy(&header, page, sizeof(header));
+        auto entries = page + sizeof(NodeHeader);
+        for (uint32_t i = 0; i < header.count; i++)
+        {
+          if (header.leaf)
+          {
+            Item item;
+            std::memcpy(&item, entries + i * sizeof(Item), sizeof(Item));
+            if (bboxIntersects(bbox, item.bbox) && !visitor(item.bbox, item.data))
+              return true;
+          }
+          else
+          {
+            ChildEntry child;
+            std::memcpy(&child, entries + i * sizeof(ChildEntry), sizeof(ChildEntry));
+            if (bboxIntersects(bbox, child.bbox))
+              nodesToSearch.push_back(child.page);
+          }
+        }
+      }
+      return true;
+    };
+
+    // data of the items intersecting bbox, or NULL if a page can't be read
+    std::vector<T> *search(const Bbox& bbox)
+    {
+      auto result = new std::vector<T>();
+      if (!this->search(bbox, [result](const Bbox&, const T& data) { result->push_back(data); return true; }))
+      {
+        delete result;
+        return NULL;
+      }
+      return result;
+    };
+  };
+
+  template <class T>
+  const std::size_t PagedRBush<T>::MaxFanIn;
+
+  template <class T>
+  const uint64_t PagedRBush<T>::Magic;
+
+}
+
+
+#endif // PAGEDRBUSH_HPP
@@ -0,0 +1,220 @@
+#ifndef POINTRBUSH_HPP
+#define POINTRBUSH_HPP
+
+
+//
+// PointRBush is a variant of RBush specialized for point datasets.
+//
+// Leaves don't hold TreeNode items: all points are packed in a single array of
+// (x, y, payload index) entries, sorted in leaf order, and each leaf only keeps
+// the range of its entries. Payloads are stored once, in insertion order, and
+// are reached through the index only when a point matches the query.
+//
+// The tree is bulk loaded at construction with the same OMT algorithm as RBush.
+//
+
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "RBush.hpp"
+
+namespace rbush
+{
+  template <class T>
+  struct PointItem
+  {
+    double x;
+    double y;
+    T data;
+  };
+
+  struct PointEntry
+  {
+    double x;
+    double y;
+    uint32_t index;
+  };
+
+  struct PointNode
+  {
+    Bbox bbox;
+    int height;
+    bool leaf;
+    std::vector<PointNode *> *children; // internal nodes only
+    uint32_t begin;                     // leaves only: range of entries in the points array
+    uint32_t end;
+  };
+
+
+  template <class T>
+  class PointRBush
+  {
+    int _maxEntries;
+    PointNode *rootNode;
+    std::vector<PointEntry> points;
+    std::vector<T> payloads;
+
+
+    static PointNode *createNode()
+    {
+      auto node = new PointNode();
+      node->height = 1;
+      node->leaf = true;
+      node->children = NULL;
+      node->begin = 0;
+      node->end = 0;
+      node->bbox = emptyBbox();
+      return node;
+    };
+
+    static void deleteNode(PointNode *node)
+    {
+      if (node->children)
+      {
+        for (auto& child: *node->children)
+          deleteNode(child);
+        delete node->children;
+      }
+      delete node;
+    };
+
+    static bool compareX(const PointEntry& a, const PointEntry& b) { return a.x < b.x; };
+    static bool compareY(const PointEntry& a, const PointEntry& b) { return a.y < b.y; };
+
+    PointNode *_build(int left, int right, int height)
+    {
+      int N = right - left + 1;
+      int M = this->_maxEntries;
+
+      if (N <= M)
+      {
+        // reached leaf level; the entries [left, right] are already contiguous
+        auto node = createNode();
+        node->begin = left;
+        node->end = right + 1;
+        for (int i = left; i <= right; i++)
+        {
+          auto& p = this->points[i];
+          bboxExtend(node->bbox, { p.x, p.y, p.x, p.y });
+        }
+        return node;
+      }
+
+      // split the entries into mostly square tiles and pack each one recursively
+      auto node = createNode();
+      node->leaf = false;
+      node->children = new std::vector<PointNode *>();
+      node->height = omtTiles(this->points, left, right, this->_maxEntries, height, compareX, compareY, [this, node](std::size_t l, std::size_t r, int h)
+      {
+        auto child = this->_build(l, r, h);
+        bboxExtend(node->bbox, child->bbox);
+        node->children->push_back(child);
+      });
+      return node;
+    };
+
+  public:
+
+    const PointNode *root() const { return rootNode; };
+
+    PointRBush(const std::vector<PointItem<T>>& data, int maxEntries = 16)
+    {
+      this->_maxEntries = std::max(4, maxEntries);
+      this->points.reserve(data.size());
+      this->payloads.reserve(data.size());
+      for (auto& item: data)
+      {
+        this->points.push_back({ item.x, item.y, (uint32_t)this->payloads.size() });
+        this->payloads.push_back(item.data);
+      }
+      if (this->points.empty())
+        this->rootNode = createNode();
+      else
+        this->rootNode = this->_build(0, this->points.size() - 1, 0);
+    };
+
+    ~PointRBush()
+    {
+      deleteNode(this->rootNode);
+    };
+
+    std::size_t size() const { return this->points.size(); };
+
+    const T& payload(const PointEntry& entry) const { return this->payloads[entry.index]; };
+
+    // visit every point inside bbox; stops as soon as visitor returns false
+    template <class Visitor>
+    void search(const Bbox& bbox, Visitor visitor) const
+    {
+      const PointNode *node = this->rootNode;
+      if (!bboxIntersects(bbox, node->bbox))
+        return;
+
+      std::vector<const PointNode *> nodesToSearch;
+      while (node)
+      {
+        if (node->leaf)
+        {
+          if (bboxContains(bbox, node->bbox))
+          {
+            for (auto i = node->begin; i < node->end; i++)
+              if (!visitor(this->points[i], this->payloads[this->points[i].index]))
+                return;
+          }
+          else
+          {
+            for (auto i = node->begin; i < node->end; i++)
+            {
+              auto& p = this->points[i];
+              if (p.x >= bbox.minX && p.x <= bbox.maxX && p.y >= bbox.minY && p.y <= bbox.maxY)
+                if (!visitor(p, this->payloads[p.index]))
+                  return;
+            }
+          }
+        }
+        else
+        {
+          for (auto& child: *node->children)
+          {
+            if (bboxIntersects(bbox, child->bbox))
+              nodesToSearch.push_back(child);
+          }
+        }
+        if (!nodesToSearch.empty())
+        {
+          node = nodesToSearch.back();
+          nodesToSearch.pop_back();
+        }
+        else
+        {
+          node = NULL;
+        }
+      }
+    };
+
+    std::vector<const T *> *search(const Bbox& bbox) const
+    {
+      auto result = new std::vector<const T *>();
+      this->search(bbox, [result](const PointEntry&, const T& data) { result->push_back(&data); return true; });
+      return result;
+    };
+
+    std::vector<const T *> *all() const
+    {
+      auto result = new std::vector<const T *>();
+      result->reserve(this->points.size());
+      for (auto& p: this->points)
+        result->push_back(&this->payloads[p.index]);
+      return result;
+    };
+
+  };
+
+}
+
+
+#endif // POINTRBUSH_HPP
@@ -17,9 +17,17 @@
 #include <algorithm>
 #include <functional>
 #include <cmath>
+#include <cstdint>
+#include <queue>
+#include <utility>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
 
 #include <iostream>
 
+#include "MemoryResource.hpp"
+
 namespace rbush
 {
   struct Bbox
@@ -30,57 +38,609 @@ namespace rbush
     double maxY;
   };
 
+  struct Point
+  {
+    double x;
+    double y;
+  };
+
+  inline bool bboxIntersects(const Bbox& a, const Bbox& b)
+  {
+    return b.minX <= a.maxX &&
+           b.minY <= a.maxY &&
+           b.maxX >= a.minX &&
+           b.maxY >= a.minY;
+  }
+
+  // true if a contains b
+  inline bool bboxContains(const Bbox& a, const Bbox& b)
+  {
+    return a.minX <= b.minX &&
+           a.minY <= b.minY &&
+           b.maxX <= a.maxX &&
+           b.maxY <= a.maxY;
+  }
+
+  // grow a to cover b
+  inline void bboxExtend(Bbox& a, const Bbox& b)
+  {
+    a.minX = std::min(a.minX, b.minX);
+    a.minY = std::min(a.minY, b.minY);
+    a.maxX = std::max(a.maxX, b.maxX);
+    a.maxY = std::max(a.maxY, b.maxY);
+  }
+
+  // inverted bbox that any bboxExtend replaces, and that intersects nothing
+  inline Bbox emptyBbox()
+  {
+    return { std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+             std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest() };
+  }
+
+  // reorder items [left, right] in groups of n, unsorted inside a group and sorted by less between
+  // groups, by repeated selection
+  template <class Items, class Less>
+  void multiSelect(Items& items, std::size_t left, std::size_t right, std::size_t n, Less less)
+  {
+    std::vector<std::size_t> stack;
+    stack.push_back(left);
+    stack.push_back(right);
+
+    while (!stack.empty())
+    {
+      auto r = stack.back();
+      stack.pop_back();
+      auto l = stack.back();
+      stack.pop_back();
+
+      if (r - l <= n)
+        continue;
+
+      std::size_t mid = l + std::ceil((r - l) / (double)n / 2.0) * n;
+      std::nth_element(items.begin() + l, items.begin() + mid, items.begin() + r + 1, less);
+
+      stack.push_back(l);
+      stack.push_back(mid);
+      stack.push_back(mid);
+      stack.push_back(r);
+    }
+  }
+
+  // OMT bulk load step, shared by RBush and PointRBush: the items [left, right] of a node, more
+  // than maxEntries, are cut into mostly square tiles, slices along x then tiles along y, and
+  // tile(left, right, height) builds the child of each tile. height is the height of the node, or
+  // 0 at the top of the bulk load, where it is computed with a number of children maximizing
+  // storage utilization; returns it.
+  template <class Items, class LessX, class LessY, class Tile>
+  int omtTiles(Items& items, std::size_t left, std::size_t right, int maxEntries, int height, LessX lessX, LessY lessY, Tile tile)
+  {
+    std::size_t N = right - left + 1;
+    int M = maxEntries;
+    if (!height)
+    {
+      // target height of the bulk-loaded tree
+      height = std::ceil(std::log(N) / std::log(M));
+
+      // target number of root entries to maximize storage utilization
+      M = std::ceil(N / std::pow(M, height - 1));
+    }
+
+    std::size_t N2 = std::ceil(N / (double)M);
+    std::size_t N1 = N2 * std::ceil(std::sqrt(M));
+
+    multiSelect(items, left, right, N1, lessX);
+    for (auto i = left; i <= right; i += N1)
+    {
+      auto right2 = std::min(i + N1 - 1, right);
+      multiSelect(items, i, right2, N2, lessY);
+      for (auto j = i; j <= right2; j += N2)
+        tile(j, std::min(j + N2 - 1, right2), height - 1);
+    }
+    return height;
+  }
+
+  // distance used by radius queries: plain euclidean distance, or great-circle
+  // distance in meters for lon/lat coordinates given in degrees
+  enum class Metric
+  {
+    Planar,
+    Haversine
+  };
+
+  // slab test: parameter t at which the line p0 + t * (p1 - p0), t in [0, tMax], enters a;
+  // returns false if the line doesn't cross a
+  inline bool lineEnters(const Point& p0, const Point& p1, double tMax, const Bbox& a, double& t)
+  {
+    double tNear = 0;
+    double tFar = tMax;
+    double origin[2] = { p0.x, p0.y };
+    double dir[2] = { p1.x - p0.x, p1.y - p0.y };
+    double lo[2] = { a.minX, a.minY };
+    double hi[2] = { a.maxX, a.maxY };
+    for (int axis = 0; axis < 2; axis++)
+    {
+      if (dir[axis] == 0)
+      {
+        // parallel to the slab: either always or never inside it
+        if (origin[axis] < lo[axis] || origin[axis] > hi[axis])
+          return false;
+        continue;
+      }
+      auto t1 = (lo[axis] - origin[axis]) / dir[axis];
+      auto t2 = (hi[axis] - origin[axis]) / dir[axis];
+      if (t1 > t2)
+        std::swap(t1, t2);
+      tNear = std::max(tNear, t1);
+      tFar = std::min(tFar, t2);
+      if (tNear > tFar)
+        return false;
+    }
+    t = tNear;
+    return true;
+  }
+
+
+  // edges of a polygon bucketed by horizontal bands, used to locate points and boxes
+  // relative to the polygon (even-odd rule, so rings after the first are holes)
+  class PolygonEdgeIndex
+  {
+    struct Edge
+    {
+      Point p0;
+      Point p1;
+    };
+
+    std::vector<Edge> edges;
+    std::vector<std::size_t> bandStart; // edges of band i are bandEdges[bandStart[i]..bandStart[i + 1]]
+    std::vector<std::size_t> bandEdges;
+    double bandHeight;
+    Bbox _bbox;
+
+    int band(double y) const
+    {
+      int b = bandHeight > 0 ? (int)std::floor((y - _bbox.minY) / bandHeight) : 0;
+      return std::max(0, std::min((int)bandStart.size() - 2, b));
+    };
+
+  public:
+    enum Position
+    {
+      Outside,
+      Inside,
+      Straddling
+    };
+
+    // Polygon is a sequence of rings of points with x and y members, such as geojson::Polygon
+    template <class Polygon>
+    PolygonEdgeIndex(const Polygon& polygon)
+    {
+      _bbox = emptyBbox();
+      for (auto& ring: polygon)
+      {
+        for (std::size_t j = 0, len = ring.size(), k = len - 1; j < len; k = j++)
+        {
+          edges.push_back({ { ring[k].x, ring[k].y }, { ring[j].x, ring[j].y } });
+          bboxExtend(_bbox, { ring[j].x, ring[j].y, ring[j].x, ring[j].y });
+        }
+      }
+
+      // about two edges per band on average, counting sort of edges into the bands they span
+      int bands = std::max(1, (int)edges.size() / 2);
+      bandHeight = edges.empty() ? 0 : (_bbox.maxY - _bbox.minY) / bands;
+      bandStart.assign(bands + 1, 0);
+      for (auto& e: edges)
+        for (int b = band(std::min(e.p0.y, e.p1.y)), last = band(std::max(e.p0.y, e.p1.y)); b <= last; b++)
+          bandStart[b + 1]++;
+      for (int b = 0; b < bands; b++)
+        bandStart[b + 1] += bandStart[b];
+      bandEdges.resize(bandStart[bands]);
+      std::vector<std::size_t> fill(bandStart.begin(), bandStart.end() - 1);
+      for (std::size_t i = 0; i < edges.size(); i++)
+      {
+        auto& e = edges[i];
+        for (int b = band(std::min(e.p0.y, e.p1.y)), last = band(std::max(e.p0.y, e.p1.y)); b <= last; b++)
+          bandEdges[fill[b]++] = i;
+      }
+    };
+
+    const Bbox& bbox() const { return _bbox; };
+
+    bool empty() const { return edges.empty(); };
+
+    // ray casting: count the edges crossed by the horizontal ray going east from (x, y)
+    bool contains(double x, double y) const
+    {
+      if (edges.empty() || y < _bbox.minY || y > _bbox.maxY || x < _bbox.minX || x > _bbox.maxX)
+        return false;
+      bool inside = false;
+      auto b = band(y);
+      for (auto i = bandStart[b]; i < bandStart[b + 1]; i++)
+      {
+        auto& e = edges[bandEdges[i]];
+        if (((e.p0.y > y) != (e.p1.y > y)) && (x < (e.p1.x - e.p0.x) * (y - e.p0.y) / (e.p1.y - e.p0.y) + e.p0.x))
+          inside = !inside;
+      }
+      return inside;
+    };
+
+    // true if an edge of the polygon goes through a
+    bool crosses(const Bbox& a) const
+    {
+      if (edges.empty() || a.maxY < _bbox.minY || a.minY > _bbox.maxY)
+        return false;
+      double t;
+      for (int b = band(a.minY), last = band(a.maxY); b <= last; b++)
+      {
+        for (auto i = bandStart[b]; i < bandStart[b + 1]; i++)
+        {
+          auto& e = edges[bandEdges[i]];
+          if (std::max(e.p0.x, e.p1.x) < a.minX || std::min(e.p0.x, e.p1.x) > a.maxX ||
+              std::max(e.p0.y, e.p1.y) < a.minY || std::min(e.p0.y, e.p1.y) > a.maxY)
+            continue;
+          if (lineEnters(e.p0, e.p1, 1, a, t))
+            return true;
+        }
+      }
+      return false;
+    };
+
+    // a box crossed by no edge is either entirely inside or entirely outside the polygon
+    Position classify(const Bbox& a) const
+    {
+      if (this->crosses(a))
+        return Straddling;
+      return this->contains(a.minX, a.minY) ? Inside : Outside;
+    };
+  };
+
   template <class T>
-  struct TreeNode;
+  struct TreeBranch;
 
+  // An item of the tree. T is stored by value next to the bbox, so that a leaf scan reaches the
+  // payload without another dependent load; keep it small (an id, a few pointers) and use a
+  // pointer type for big payloads.
   template <class T>
   struct TreeNode
   {
     Bbox bbox;
+    TreeBranch<T> *parent;   // node holding this node or item, NULL for the root and for items in no tree
+    T data;
+  };
+
+  // A node of the tree: the node fields live here rather than in every item. The children of a
+  // leaf are items, those of the other nodes are TreeBranch (see asBranch).
+  template <class T>
+  struct TreeBranch: TreeNode<T>
+  {
+    typedef std::vector<TreeNode<T> *, pmr::polymorphic_allocator<TreeNode<T> *>> Children;
+
     int height;
     bool leaf;
-    std::vector<TreeNode *> *children;
-    T *data;
+    Children *children;
+    std::size_t count;  // number of items in the subtree
+  };
+
+  // child of a node that is not a leaf
+  template <class T>
+  TreeBranch<T> *asBranch(TreeNode<T> *node)
+  {
+    return static_cast<TreeBranch<T> *>(node);
+  }
+
+  template <class T>
+  const TreeBranch<T> *asBranch(const TreeNode<T> *node)
+  {
+    return static_cast<const TreeBranch<T> *>(node);
+  }
+
+  // children of node whose bbox intersects bbox, sorted by minX
+  template <class T>
+  void sweepCandidates(const TreeBranch<T> *node, const Bbox& bbox, std::vector<TreeNode<T> *>& candidates)
+  {
+    for (auto& child: *node->children)
+      if (bboxIntersects(bbox, child->bbox))
+        candidates.push_back(child);
+    std::sort(candidates.begin(), candidates.end(), [](const TreeNode<T> *a, const TreeNode<T> *b) { return a->bbox.minX < b->bbox.minX; });
+  }
+
+  // plane sweep along x over two lists sorted by minX: report(a, b) is called once for each
+  // intersecting pair and returns false to stop the sweep
+  template <class A, class B, class Report>
+  bool sweep(const std::vector<TreeNode<A> *>& a, const std::vector<TreeNode<B> *>& b, Report report)
+  {
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while (i < a.size() && j < b.size())
+    {
+      if (a[i]->bbox.minX <= b[j]->bbox.minX)
+      {
+        for (auto k = j; k < b.size() && b[k]->bbox.minX <= a[i]->bbox.maxX; k++)
+          if (a[i]->bbox.minY <= b[k]->bbox.maxY && b[k]->bbox.minY <= a[i]->bbox.maxY)
+            if (!report(a[i], b[k]))
+              return false;
+        i++;
+      }
+      else
+      {
+        for (auto k = i; k < a.size() && a[k]->bbox.minX <= b[j]->bbox.maxX; k++)
+          if (a[k]->bbox.minY <= b[j]->bbox.maxY && b[j]->bbox.minY <= a[k]->bbox.maxY)
+            if (!report(a[k], b[j]))
+              return false;
+        j++;
+      }
+    }
+    return true;
+  }
+
+  // plane sweep of a list sorted by minX against itself: each intersecting pair is reported once
+  template <class T, class Report>
+  bool selfSweep(const std::vector<TreeNode<T> *>& a, Report report)
+  {
+    for (std::size_t i = 0; i < a.size(); i++)
+      for (auto k = i + 1; k < a.size() && a[k]->bbox.minX <= a[i]->bbox.maxX; k++)
+        if (a[i]->bbox.minY <= a[k]->bbox.maxY && a[k]->bbox.minY <= a[i]->bbox.maxY)
+          if (!report(a[i], a[k]))
+            return false;
+    return true;
+  }
+
+  // synchronized traversal of two subtrees whose bboxes intersect; at equal heights, the children
+  // of both nodes are paired by plane sweep, otherwise the higher node is descended alone.
+  // onPair(a, b) gets each pair of intersecting nodes (or items when a and b are leaves).
+  template <class A, class B, class OnPair>
+  bool joinChildren(const TreeBranch<A> *a, const TreeBranch<B> *b, OnPair onPair)
+  {
+    if (a->height > b->height)
+    {
+      for (auto& child: *a->children)
+        if (bboxIntersects(child->bbox, b->bbox))
+          if (!onPair(child, const_cast<TreeBranch<B> *>(b)))
+            return false;
+      return true;
+    }
+    if (b->height > a->height)
+    {
+      for (auto& child: *b->children)
+        if (bboxIntersects(a->bbox, child->bbox))
+          if (!onPair(const_cast<TreeBranch<A> *>(a), child))
+            return false;
+      return true;
+    }
+
+    // only children inside the intersection of both nodes can be part of a pair
+    Bbox common = { std::max(a->bbox.minX, b->bbox.minX), std::max(a->bbox.minY, b->bbox.minY),
+                    std::min(a->bbox.maxX, b->bbox.maxX), std::min(a->bbox.maxY, b->bbox.maxY) };
+    std::vector<TreeNode<A> *> childrenA;
+    std::vector<TreeNode<B> *> childrenB;
+    sweepCandidates(a, common, childrenA);
+    sweepCandidates(b, common, childrenB);
+    return sweep(childrenA, childrenB, onPair);
+  }
+
+  template <class A, class B, class Visitor>
+  bool joinNodes(const TreeBranch<A> *a, const TreeBranch<B> *b, Visitor& visitor)
+  {
+    bool items = a->leaf && b->leaf && a->height == b->height;
+    return joinChildren(a, b, [&](TreeNode<A> *ca, TreeNode<B> *cb) { return items ? (bool)visitor(ca, cb) : joinNodes(asBranch(ca), asBranch(cb), visitor); });
+  }
+
+  // node capacity given at run time to the RBush constructor instead of as a template argument
+  const int Dynamic = 0;
+
+  // per-node aggregate of RBush: by default nodes keep none
+  struct NoAggregate {};
+
+  // the item count, cached in every node, as a monoid for RBush::count()
+  struct CountMonoid
+  {
+    typedef std::size_t value_type;
+
+    static std::size_t identity() { return 0; };
+    static std::size_t combine(std::size_t a, std::size_t b) { return a + b; };
+  };
+
+  // With an Aggregate monoid, e.g.
+  //
+  //   struct Population
+  //   {
+  //     typedef double value_type;
+  //     static double identity() { return 0; }
+  //     static double combine(double a, double b) { return a + b; }
+  //     static double value(const rbush::TreeNode<City> *item) { return item->data.population; }
+  //   };
+  //
+  // each node of the tree holds the combination of the values of the items of its subtree.
+  template <class T, class Aggregate>
+  struct AggregateNode: TreeBranch<T>
+  {
+    typename Aggregate::value_type value;
   };
 
+  // node type of RBush and upkeep of its aggregate
+  template <class T, class Aggregate>
+  struct Aggregation
+  {
+    typedef AggregateNode<T, Aggregate> Node;
+    typedef typename Aggregate::value_type Value;
+
+    static const Value& of(const TreeNode<T> *node) { return static_cast<const Node *>(node)->value; };
+
+    static Value valueOf(const TreeNode<T> *child, bool item) { return item ? Aggregate::value(child) : of(child); };
+
+    static void init(TreeBranch<T>& node) { static_cast<Node&>(node).value = Aggregate::identity(); };
+
+    // recompute the aggregate of node from its children
+    static void calc(TreeBranch<T>& node)
+    {
+      Value value = Aggregate::identity();
+      for (auto& child: *node.children)
+        value = Aggregate::combine(value, valueOf(child, node.leaf));
+      static_cast<Node&>(node).value = value;
+    };
+
+    // node gets child (an item or a node) in its subtree
+    static void add(TreeBranch<T> *node, const TreeNode<T> *child, bool item)
+    {
+      auto& value = static_cast<Node *>(node)->value;
+      value = Aggregate::combine(value, valueOf(child, item));
+    };
+  };
 
   template <class T>
+  struct Aggregation<T, NoAggregate>
+  {
+    typedef TreeBranch<T> Node;
+
+    static void init(TreeBranch<T>&) {};
+    static void calc(TreeBranch<T>&) {};
+    static void add(TreeBranch<T> *, const TreeNode<T> *, bool) {};
+  };
+
+  // Attribute summaries for searchWhere(): Attribute::value(item) gives the attribute of an item.
+  //
+  // MaskSummary ORs 64-bit category masks up the tree; filter with e.g.
+  // [](uint64_t mask) { return mask & (Roads | Rivers); }
+  template <class Attribute>
+  struct MaskSummary
+  {
+    typedef uint64_t value_type;
+
+    static uint64_t identity() { return 0; };
+    static uint64_t combine(uint64_t a, uint64_t b) { return a | b; };
+    template <class Item>
+    static uint64_t value(const Item *item) { return Attribute::value(item); };
+  };
+
+  // RangeSummary keeps the min and max of a V attribute in each subtree; filter with e.g.
+  // [](const std::pair<double, double>& r) { return r.first <= t1 && r.second >= t0; }
+  template <class V, class Attribute>
+  struct RangeSummary
+  {
+    typedef std::pair<V, V> value_type;
+
+    static value_type identity() { return value_type(std::numeric_limits<V>::max(), std::numeric_limits<V>::lowest()); };
+    static value_type combine(const value_type& a, const value_type& b) { return value_type(std::min(a.first, b.first), std::max(a.second, b.second)); };
+    template <class Item>
+    static value_type value(const Item *item) { V v = Attribute::value(item); return value_type(v, v); };
+  };
+
+  // Node split algorithms of RBush, from the cheapest to the one giving the best trees:
+  // LinearSplit (Ang-Tan) sends each child to the side of the node it is nearest to, along the
+  // axis giving the most even split; QuadraticSplit (Guttman) starts from the two children that
+  // would waste the most area together and adds the others by decreasing preference; RStarSplit
+  // picks the axis with the lowest total margin, then the distribution with the least overlap.
+  struct LinearSplit {};
+  struct QuadraticSplit {};
+  struct RStarSplit {};
+
+  // shape of a tree, degrading with one-by-one insertions compared to a bulk load
+  struct TreeQuality
+  {
+    std::size_t nodes;
+    double overlap;        // area of the pairwise intersections of sibling nodes over their total area
+    double fill;           // average number of children of a node over the capacity
+    double nodesVisited;   // expected number of nodes visited by a point query uniformly spread
+                           // over the root bbox: the sum of node areas over the root area
+  };
+
+  // MaxEntries is the node capacity. A compile-time capacity is a constant and a reservation hint
+  // only: child arrays are reserved once to capacity + 1, but they stay heap-allocated vectors,
+  // nodes are not fixed-size and loops over children run to the actual number of children.
+  // Use RBush<T, Dynamic> for a capacity chosen at run time through the constructor. Aggregate is
+  // an optional monoid kept up to date in every node, for aggregate(bbox) queries. Split is the
+  // node split algorithm.
+  template <class T, int MaxEntries = 9, class Aggregate = NoAggregate, class Split = RStarSplit>
   class RBush
   {
+    static constexpr double EarthRadius = 6371008.8; // mean earth radius in meters
+    static constexpr double DegToRad = M_PI / 180;
+
+    static constexpr int StaticMaxEntries = MaxEntries < 4 ? 4 : MaxEntries;
+    static constexpr int StaticMinEntries = (StaticMaxEntries * 2 + 4) / 5 < 2 ? 2 : (StaticMaxEntries * 2 + 4) / 5; // ceil(40%)
+
+    // child arrays, allocated from the tree memory resource
+    typedef typename TreeBranch<T>::Children Children;
+
+    // traversal stacks of read-only queries use the global heap, never the tree resource: queries
+    // don't grow a monotonic resource and can run concurrently on a tree whose resource is not
+    // synchronized. Insertion paths, which are just as temporary, use the global heap as well.
+    typedef std::vector<TreeBranch<T> *> Stack;
+
+    // what a traversal does with a child, see _visit
+    enum Match { Skip, Descend, Take };
+
+    // nodes created by the tree; items are plain TreeNode<T>
+    typedef Aggregation<T, Aggregate> Aggregates;
+    typedef typename Aggregates::Node Node;
+
     int _maxEntries;
     int _minEntries;
-    TreeNode<T> *rootNode;
+    pmr::memory_resource *resource;
+    TreeBranch<T> *rootNode;
+
+    // leaf of the last inserted item, NULL once that leaf is freed
+    TreeBranch<T> *_lastLeaf;
+
+    // loose bboxes: padding of the bboxes stored for inserted and updated items
+    double _looseMargin;
+    double _looseVelocity;
+
+    // background rebuild: a worker thread bulk loads a snapshot of the items into a separate tree
+    // of proxies while this one keeps serving; the items inserted, removed or moved meanwhile are
+    // logged in dirty (true for items in the tree, false for removed ones) and replayed at the swap
+    struct Rebuild
+    {
+      std::vector<TreeNode<T> *> items;
+      std::vector<TreeNode<T>> proxies;   // proxy i stands for items[i]
+      RBush<T, Dynamic> *fresh;
+      std::atomic<bool> done;
+      std::thread worker;
+      std::unordered_map<TreeNode<T> *, bool> dirty;
+    };
+    Rebuild *_rebuild;
+    double _rebuildFactor;       // automatic rebuild when nodesVisited grows by this factor, 0 for none
+    double _builtNodesVisited;   // quality().nodesVisited after the last bulk load, 0 if none
+    std::size_t _mutations;      // since the last quality check
+
+    // the nodes are left to the resource at destruction, see releaseWithResource()
+    bool _releaseWithResource;
+
+    int maxEntries() const { return MaxEntries ? StaticMaxEntries : this->_maxEntries; };
+    int minEntries() const { return MaxEntries ? StaticMinEntries : this->_minEntries; };
 
 
    // calculate node's bbox from bboxes of its children
-    static void calcBBox(TreeNode<T>& node)
+    void calcBBox(TreeBranch<T>& node)
     {
-      distBBox(node, 0, node.children->size(), &node);
+      node.bbox = distBBox(node, 0, node.children->size());
+      calcCount(node);
+      Aggregates::calc(node);
     };
 
-    // min bounding rectangle of node children from k to p-1
-    static TreeNode<T> *distBBox(TreeNode<T>& node, int k, int p, TreeNode<T> *destNode)
-    {
-      if (!destNode)
-        destNode = createNode(NULL);
-      destNode->bbox.minX = std::numeric_limits<int>::max();
-      destNode->bbox.minY = std::numeric_limits<int>::max();
-      destNode->bbox.maxX = std::numeric_limits<int>::lowest();
-      destNode->bbox.maxY = std::numeric_limits<int>::lowest();
-      for (auto i = k; i < p; i++)
+    // calculate node's item count from the counts of its children
+    static void calcCount(TreeBranch<T>& node)
+    {
+      if (node.leaf)
       {
-        auto child = (*node.children)[i];
-        extend(destNode->bbox, child->bbox);
+        node.count = node.children->size();
+        return;
       }
-      return destNode;
+      node.count = 0;
+      for (auto& child: *node.children)
+        node.count += asBranch(child)->count;
     };
 
-    static void extend(Bbox& a, const Bbox& b)
+    // min bounding rectangle of node children from k to p-1
+    static Bbox distBBox(const TreeBranch<T>& node, int k, int p)
     {
-      a.minX = std::min(a.minX, b.minX);
-      a.minY = std::min(a.minY, b.minY);
-      a.maxX = std::max(a.maxX, b.maxX);
-      a.maxY = std::max(a.maxY, b.maxY);
+      Bbox bbox;
+      bbox.minX = std::numeric_limits<int>::max();
+      bbox.minY = std::numeric_limits<int>::max();
+      bbox.maxX = std::numeric_limits<int>::lowest();
+      bbox.maxY = std::numeric_limits<int>::lowest();
+      for (auto i = k; i < p; i++)
+        bboxExtend(bbox, (*node.children)[i]->bbox);
+      return bbox;
     };
 
     static bool compareNodeMinX(const TreeNode<T> *a, const TreeNode<T> *b) { return a->bbox.minX < b->bbox.minX; };
@@ -106,135 +666,110 @@ namespace rbush
              std::max(0.0, maxY - minY);
     };
 
-    static bool contains(const Bbox& a, const Bbox& b)
+    // point in box with non short-circuit ands: four compares and no branch
+    static bool holdsPoint(const Bbox& a, double x, double y)
     {
-      return a.minX <= b.minX &&
-             a.minY <= b.minY &&
-             b.maxX <= a.maxX &&
-             b.maxY <= a.maxY;
+      return (a.minX <= x) & (x <= a.maxX) & (a.minY <= y) & (y <= a.maxY);
     };
 
-    static bool intersects(const Bbox& a, const Bbox& b)
+    // squared euclidean distance from (x, y) to the closest point of a
+    static double boxDistSq(double x, double y, const Bbox& a)
     {
-      return b.minX <= a.maxX &&
-             b.minY <= a.maxY &&
-             b.maxX >= a.minX &&
-             b.maxY >= a.minY;
+      auto dx = std::max(0.0, std::max(a.minX - x, x - a.maxX));
+      auto dy = std::max(0.0, std::max(a.minY - y, y - a.maxY));
+      return dx * dx + dy * dy;
     };
 
-    static TreeNode<T> *createNode(std::vector<TreeNode<T> *> *children)
+    // squared euclidean distance from (x, y) to the farthest corner of a
+    static double farBoxDistSq(double x, double y, const Bbox& a)
     {
-      auto node = new TreeNode<T>();
-      node->height = 1;
-      node->leaf = true;
-      node->children = children,
-      node->bbox.minX = std::numeric_limits<int>::max();
-      node->bbox.minY = std::numeric_limits<int>::max();
-      node->bbox.maxX = std::numeric_limits<int>::lowest();
-      node->bbox.maxY = std::numeric_limits<int>::lowest();
-      return node;
+      auto dx = std::max(std::abs(x - a.minX), std::abs(x - a.maxX));
+      auto dy = std::max(std::abs(y - a.minY), std::abs(y - a.maxY));
+      return dx * dx + dy * dy;
     };
 
-
-    // Floyd–Rivest algorithm (https://en.wikipedia.org/wiki/Floyd%E2%80%93Rivest_algorithm)
-    // left is the left index for the interval
-    // right is the right index for the interval
-    // k is the desired index value, where array[k] is the (k+1)th smallest element when left = 0
-    static void quickselect(std::vector<TreeNode<T> *>array, int left, int right, int k, std::function<double(const TreeNode<T> *, const TreeNode<T> *)> compare)
+    static double haverSin(double theta)
     {
-      //std::cerr << "quickselect([0-"<< array.size()-1 << "]," << k << "," << left << "," << right << ")\n";
-      #define sign(x) ((x > 0.0) ? 1 : ((x < 0.0) ? (-1) : 0))
-      #define F_SWAP(a,b) { TreeNode<T> *temp=(a);(a)=(b);(b)=temp; }
-      while (right > left)
-      {
-        // use select recursively to sample a smaller set of size s
-        // the arbitrary constants 600 and 0.5 are used in the original
-        // version to minimize execution time
-        if (right - left > 600)
-        {
-          int n = right - left + 1;
-          int i = k - left + 1;
-          double z = std::log(n);
-          double s = 0.5 * std::exp(2.0 * z / 3.0);
-          double sd = 0.5 * std::sqrt(z * s * (n - s) / n) * (i - n / 2.0 < 0 ? -1 : 1);
-          int newLeft = std::max(left, (int)std::floor(k - i * s / n + sd));
-          int newRight = std::min(right, (int)std::floor(k + (n - i) * s / n + sd));
-          //std::cerr << "quickselect_r([0-"<< array.size()-1 << "]," << k << "," << newLeft << "," << newRight << ")\n";
-          quickselect(array, k, newLeft, newRight, compare);
-        }
-        // partition the elements between left and right around t
-        auto t = array[k];
-        int i = left;
-        int j = right;
-        F_SWAP(array[left], array[k]); //swap array[left] and array[k]
-        if (compare(array[right], t) > 0) //array[right] > t
-           F_SWAP(array[left], array[right]); //swap array[right] and array[left]
-        while (i < j)
-        {
-          F_SWAP(array[i], array[j]); //swap array[i] and array[j]
-          i++;
-          j--;
-          while (compare(array[i], t) < 0) //array[i] < t
-            i++;
-          while (compare(array[j], t) > 0) // array[j] > t
-            j--;
-        }
-        if (compare(array[left], t) == 0) //array[left] = t
-        {
-          F_SWAP(array[left], array[j]); //swap array[left] and array[j]
-        }
-        else
-        {
-          j++;
-          F_SWAP(array[j], array[right]); //swap array[j] and array[right]
-        }
-        // adjust left and right towards the boundaries of the subset
-        // containing the (k - left + 1)th smallest element
-        if (j <= k)
-           left = j + 1;
-        if (k <= j)
-           right = j - 1;
-     }
-   };
+      auto s = std::sin(theta / 2);
+      return s * s;
+    };
 
-    // sort an array so that items come in groups of n unsorted items, with groups sorted between each other;
-    // combines selection algorithm with binary divide & conquer approach
+    static double haverSinDPartial(double haverSinDLng, double cosLat1, double lat1, double lat2)
+    {
+      return cosLat1 * std::cos(lat2 * DegToRad) * haverSinDLng + haverSin((lat1 - lat2) * DegToRad);
+    };
 
-    static void multiSelect(std::vector<TreeNode<T> *>arr, int ileft, int iright, int n, std::function<double(const TreeNode<T> *, const TreeNode<T> *)> compare)
+    // latitude of the point of the great circle going through (lng, lat) that is closest to a meridian
+    static double vertexLat(double lat, double haverSinDLng)
     {
-      //std::cerr << "multiSelect([0-"<< arr.size()-1 << "]," << ileft << "," << iright << "," << n << ")\n";
-      
-      std::vector<int> stack;
-      stack.push_back(ileft);
-      stack.push_back(iright);
+      auto cosDLng = 1 - 2 * haverSinDLng;
+      if (cosDLng <= 0)
+        return lat > 0 ? 90 : -90;
+      return std::atan(std::tan(lat * DegToRad) / cosDLng) / DegToRad;
+    };
 
-      while (!stack.empty())
+    // haversine of the great-circle angle from (lng, lat) to the closest point of a
+    // (port of the box distance of https://github.com/mourner/geokdbush)
+    static double haverBoxDist(double lng, double lat, double cosLat, const Bbox& a)
+    {
+      // query point is between minimum and maximum longitudes
+      if (lng >= a.minX && lng <= a.maxX)
       {
-        int right = stack.back();
-        stack.pop_back();
-        int left = stack.back();
-        stack.pop_back();
+        if (lat < a.minY) return haverSin((lat - a.minY) * DegToRad);
+        if (lat > a.maxY) return haverSin((lat - a.maxY) * DegToRad);
+        return 0;
+      }
 
-        if (right - left <= n)
-          continue;
+      // query point is west or east of the bounding box;
+      // calculate the extremum for great circle distance from query point to the closest longitude
+      auto haverSinDLng = std::min(haverSin((lng - a.minX) * DegToRad), haverSin((lng - a.maxX) * DegToRad));
+      auto extremumLat = vertexLat(lat, haverSinDLng);
 
-        int mid = left + std::ceil((right - left) / n / 2.0) * n;
+      // if extremum is inside the box, return the distance to it
+      if (extremumLat > a.minY && extremumLat < a.maxY)
+        return haverSinDPartial(haverSinDLng, cosLat, lat, extremumLat);
 
-        quickselect(arr, left, right, mid, compare);
+      // otherwise return the distance to one of the bbox corners (whichever is closest)
+      return std::min(haverSinDPartial(haverSinDLng, cosLat, lat, a.minY),
+                      haverSinDPartial(haverSinDLng, cosLat, lat, a.maxY));
+    };
 
-        stack.push_back(left);
-        stack.push_back(mid);
-        stack.push_back(mid);
-        stack.push_back(right);
-      }
+    Children *newChildren()
+    {
+      auto children = new (this->resource->allocate(sizeof(Children), alignof(Children))) Children(this->resource);
+      if (MaxEntries)
+        children->reserve(StaticMaxEntries + 1); // room for the overflowing child before a split
+      return children;
+    };
+
+    static void addChild(TreeBranch<T> *node, TreeNode<T> *child)
+    {
+      node->children->push_back(child);
+      child->parent = node;
+    };
+
+    TreeBranch<T> *createNode(Children *children)
+    {
+      TreeBranch<T> *node = new (this->resource->allocate(sizeof(Node), alignof(Node))) Node();
+      node->height = 1;
+      node->leaf = true;
+      node->children = children;
+      node->parent = NULL;
+      node->count = 0;
+      Aggregates::init(*node);
+      node->bbox.minX = std::numeric_limits<int>::max();
+      node->bbox.minY = std::numeric_limits<int>::max();
+      node->bbox.maxX = std::numeric_limits<int>::lowest();
+      node->bbox.maxY = std::numeric_limits<int>::lowest();
+      return node;
     };
 
 
-    TreeNode<T> *_chooseSubtree(Bbox bbox, TreeNode<T> *node, int level, std::vector<TreeNode<T> *>& path)
+    TreeBranch<T> *_chooseSubtree(Bbox bbox, TreeBranch<T> *node, int level, Stack& path)
     {
-      int minArea;
-      int minEnlargement;
-      TreeNode<T> *targetNode = NULL;
+      double minArea;
+      double minEnlargement;
+      TreeBranch<T> *targetNode = NULL;
 
       while (true)
       {
@@ -243,8 +778,9 @@ namespace rbush
         if (node->leaf || (int)path.size() - 1 == level)
           break;
 
-        minArea = std::numeric_limits<int>::max();
-        minEnlargement = std::numeric_limits<int>::max();
+        minArea = std::numeric_limits<double>::infinity();
+        minEnlargement = std::numeric_limits<double>::infinity();
+        targetNode = NULL;
 
         for (auto& child: *node->children)
         {
@@ -256,7 +792,7 @@ namespace rbush
           {
             minEnlargement = enlargement;
             minArea = area < minArea ? area : minArea;
-            targetNode = child;
+            targetNode = asBranch(child);
           }
           else if (enlargement == minEnlargement)
           {
@@ -264,43 +800,44 @@ namespace rbush
             if (area < minArea)
             {
               minArea = area;
-              targetNode = child;
+              targetNode = asBranch(child);
             }
           }
         }
-        node = targetNode ? targetNode : (*node->children)[0];
+        node = targetNode ? targetNode : asBranch((*node->children)[0]);
       }
       return node;
     };
 
     // total margin of all possible split distributions where each node is at least m full
-    int _allDistMargin(TreeNode<T> &node, int m, int M, std::function<bool(const TreeNode<T> *, const TreeNode<T> *)> compare)
+    template <class Compare>
+    double _allDistMargin(TreeBranch<T> &node, int m, int M, Compare compare)
     {
       std::sort(node.children->begin(), node.children->end(), compare);
       
-      auto leftBBox = distBBox(node, 0, m, NULL);
-      auto rightBBox = distBBox(node, M - m, M, NULL);
-      auto margin = bboxMargin(leftBBox->bbox) + bboxMargin(rightBBox->bbox);
+      auto leftBBox = distBBox(node, 0, m);
+      auto rightBBox = distBBox(node, M - m, M);
+      auto margin = bboxMargin(leftBBox) + bboxMargin(rightBBox);
 
       for (int i = m; i < M - m; i++)
       {
         auto child = (*node.children)[i];
-        extend(leftBBox->bbox, child->bbox);
-        margin += bboxMargin(leftBBox->bbox);
+        bboxExtend(leftBBox, child->bbox);
+        margin += bboxMargin(leftBBox);
       }
 
       for (int i = M - m - 1; i >= m; i--)
       {
         auto child = (*node.children)[i];
-        extend(rightBBox->bbox, child->bbox);
-        margin += bboxMargin(rightBBox->bbox);
+        bboxExtend(rightBBox, child->bbox);
+        margin += bboxMargin(rightBBox);
       }
 
       return margin;
     };
 
     // sorts node children by the best axis for split
-    void _chooseSplitAxis(TreeNode<T> *node, int m, int M)
+    void _chooseSplitAxis(TreeBranch<T> *node, int m, int M)
     {
       auto xMargin = this->_allDistMargin(*node, m, M, compareNodeMinX);
       auto yMargin = this->_allDistMargin(*node, m, M, compareNodeMinY);
@@ -311,33 +848,175 @@ namespace rbush
         std::sort(node->children->begin(), node->children->end(), compareNodeMinX);
     };
 
+    // The _distribute overloads reorder the children of an overflowed node so that the first
+    // ones stay in node and the others move to the new node, and return the number of the first.
+
+    int _distribute(TreeBranch<T> *node, int m, int M, RStarSplit)
+    {
+      this->_chooseSplitAxis(node, m, M);
+      return this->_chooseSplitIndex(*node, m, M);
+    };
+
+    int _distribute(TreeBranch<T> *node, int m, int M, LinearSplit)
+    {
+      auto& children = *node->children;
+      auto& b = node->bbox;
+      auto nearMinX = [&b](const TreeNode<T> *c) { return c->bbox.minX - b.minX < b.maxX - c->bbox.maxX; };
+      auto nearMinY = [&b](const TreeNode<T> *c) { return c->bbox.minY - b.minY < b.maxY - c->bbox.maxY; };
+
+      // split along the axis giving the most even groups, then the least overlap
+      int nx = std::count_if(children.begin(), children.end(), nearMinX);
+      int ny = std::count_if(children.begin(), children.end(), nearMinY);
+      int unevenX = std::max(nx, M - nx);
+      int unevenY = std::max(ny, M - ny);
+      bool x = unevenX < unevenY;
+      if (unevenX == unevenY)
+      {
+        std::partition(children.begin(), children.end(), nearMinY);
+        auto overlapY = intersectionArea(distBBox(*node, 0, ny), distBBox(*node, ny, M));
+        std::partition(children.begin(), children.end(), nearMinX);
+        auto overlapX = intersectionArea(distBBox(*node, 0, nx), distBBox(*node, nx, M));
+        x = overlapX <= overlapY;
+      }
+
+      if (x)
+      {
+        std::partition(children.begin(), children.end(), nearMinX);
+        return this->_balance(node, nx, m, M, compareNodeMinX);
+      }
+      std::partition(children.begin(), children.end(), nearMinY);
+      return this->_balance(node, ny, m, M, compareNodeMinY);
+    };
+
+    // make both groups of a split at index hold at least m children, moving the extreme ones
+    template <class Compare>
+    int _balance(TreeBranch<T> *node, int index, int m, int M, Compare compare)
+    {
+      auto& children = *node->children;
+      if (index < m)
+      {
+        std::nth_element(children.begin(), children.begin() + m, children.end(), compare);
+        return m;
+      }
+      if (index > M - m)
+      {
+        std::nth_element(children.begin(), children.begin() + (M - m), children.end(), compare);
+        return M - m;
+      }
+      return index;
+    };
+
+    int _distribute(TreeBranch<T> *node, int m, int M, QuadraticSplit)
+    {
+      auto& children = *node->children;
+
+      // seeds: the pair of children wasting the most area in a common node
+      int seed1 = 0;
+      int seed2 = 1;
+      double maxWaste = std::numeric_limits<double>::lowest();
+      for (int i = 0; i < M; i++)
+      {
+        for (int j = i + 1; j < M; j++)
+        {
+          auto waste = enlargedArea(children[i]->bbox, children[j]->bbox) - bboxArea(children[i]->bbox) - bboxArea(children[j]->bbox);
+          if (waste > maxWaste)
+          {
+            maxWaste = waste;
+            seed1 = i;
+            seed2 = j;
+          }
+        }
+      }
+
+      // group 1 grows at the front of the children, group 2 at the back, the others stay between
+      std::swap(children[0], children[seed1]);
+      std::swap(children[M - 1], children[seed2]);
+      int n1 = 1;
+      int n2 = 1;
+      Bbox bbox1 = children[0]->bbox;
+      Bbox bbox2 = children[M - 1]->bbox;
+
+      while (n1 + n2 < M)
+      {
+        int left = M - n1 - n2;
+        // one group needs all the remaining children to reach m
+        if (n1 + left == m)
+        {
+          for (int i = n1; i < M - n2; i++)
+            bboxExtend(bbox1, children[i]->bbox);
+          n1 += left;
+          break;
+        }
+        if (n2 + left == m)
+        {
+          n2 += left;
+          break;
+        }
+
+        // next: the child with the strongest preference for a group
+        int next = n1;
+        double maxPreference = -1;
+        double d1 = 0;
+        double d2 = 0;
+        for (int i = n1; i < M - n2; i++)
+        {
+          auto e1 = enlargedArea(bbox1, children[i]->bbox) - bboxArea(bbox1);
+          auto e2 = enlargedArea(bbox2, children[i]->bbox) - bboxArea(bbox2);
+          if (std::abs(e1 - e2) > maxPreference)
+          {
+            maxPreference = std::abs(e1 - e2);
+            next = i;
+            d1 = e1;
+            d2 = e2;
+          }
+        }
+
+        // to the group needing the least enlargement, then the smallest, then the one with fewer children
+        bool first = d1 < d2 || (d1 == d2 && (bboxArea(bbox1) < bboxArea(bbox2) || (bboxArea(bbox1) == bboxArea(bbox2) && n1 <= n2)));
+        if (first)
+        {
+          bboxExtend(bbox1, children[next]->bbox);
+          std::swap(children[n1], children[next]);
+          n1++;
+        }
+        else
+        {
+          bboxExtend(bbox2, children[next]->bbox);
+          std::swap(children[M - n2 - 1], children[next]);
+          n2++;
+        }
+      }
+      return n1;
+    };
 
     // split overflowed node into two
-    void _split(std::vector<TreeNode<T> *>& insertPath, int level)
+    void _split(Stack& insertPath, int level)
     {
       auto node = insertPath[level];
-      int M = node->children->size();
-      int m = this->_minEntries;
+      // an overflowed node holds exactly one child more than the capacity
+      int M = MaxEntries ? StaticMaxEntries + 1 : node->children->size();
+      int m = this->minEntries();
 
-      this->_chooseSplitAxis(node, m, M);
-      int splitIndex = this->_chooseSplitIndex(*node, m, M);
+      int splitIndex = this->_distribute(node, m, M, Split());
       
       //node->children.splice(splitIndex, node.children.length - splitIndex)
-      std::vector<TreeNode<T> *> spliced;
-      spliced.insert(spliced.end(), node->children->begin() + splitIndex, node->children->begin() + node->children->size() - splitIndex);
-      node->children->erase(node->children->begin() + splitIndex, node->children->begin() + node->children->size() - splitIndex);
-      auto newNode = createNode(&spliced);
+      auto spliced = this->newChildren();
+      spliced->insert(spliced->end(), node->children->begin() + splitIndex, node->children->end());
+      node->children->erase(node->children->begin() + splitIndex, node->children->end());
+      auto newNode = createNode(spliced);
       newNode->height = node->height;
       newNode->leaf = node->leaf;
+      for (auto& child: *spliced)
+        child->parent = newNode;
 
       calcBBox(*node);
       calcBBox(*newNode);
 
-      if (level) insertPath[level - 1]->children->push_back(newNode);
+      if (level) addChild(insertPath[level - 1], newNode);
       else this->_splitRoot(node, newNode);
     };
 
-    int _chooseSplitIndex(TreeNode<T> &node, int m, int M)
+    int _chooseSplitIndex(TreeBranch<T> &node, int m, int M)
     {
       int index = 0;
 
@@ -346,11 +1025,11 @@ namespace rbush
 
       for (int i = m; i <= M - m; i++)
       {
-        auto bbox1 = distBBox(node, 0, i, NULL);
-        auto bbox2 = distBBox(node, i, M, NULL);
+        auto bbox1 = distBBox(node, 0, i);
+        auto bbox2 = distBBox(node, i, M);
 
-        auto overlap = intersectionArea(bbox1->bbox, bbox2->bbox);
-        auto area = bboxArea(bbox1->bbox) + bboxArea(bbox2->bbox);
+        auto overlap = intersectionArea(bbox1, bbox2);
+        auto area = bboxArea(bbox1) + bboxArea(bbox2);
 
         // choose distribution with minimum overlap
         if (overlap < minOverlap)
@@ -372,27 +1051,38 @@ namespace rbush
     };
 
 
-    void insert(TreeNode<T> *item)
-    {
-      this->_insert(item, this->rootNode->height - 1, false);
-    };
-    
-    void _insert(TreeNode<T> *item, int level, bool isNode)
+    // insert item at the given level, choosing the subtree from start (root by default) downwards
+    void _insert(TreeNode<T> *item, int level, bool isNode, TreeBranch<T> *start = NULL)
     {
       Bbox bbox = item->bbox;
-      std::vector<TreeNode<T> *> insertPath;
-      
+      Stack insertPath;
+
+      // when starting below the root, the insertion path begins with the ancestors of start
+      if (start)
+      {
+        for (auto ancestor = start->parent; ancestor; ancestor = ancestor->parent)
+          insertPath.push_back(ancestor);
+        std::reverse(insertPath.begin(), insertPath.end());
+      }
+      else
+        start = this->rootNode;
+
       // find the best node for accommodating the item, saving all nodes along the path too
-      auto node = this->_chooseSubtree(bbox, this->rootNode, level, insertPath);
+      auto node = this->_chooseSubtree(bbox, start, level, insertPath);
 
       // put the item into the node
-      node->children->push_back(item);
-      extend(node->bbox, bbox);
+      addChild(node, item);
+      bboxExtend(node->bbox, bbox);
+      for (int i = level; i >= 0; i--)
+      {
+        insertPath[i]->count += isNode ? asBranch(item)->count : 1;
+        Aggregates::add(insertPath[i], item, !isNode);
+      }
 
       // split on node overflow; propagate upwards if necessary
       while (level >= 0)
       {
-        if ((int)insertPath[level]->children->size() > this->_maxEntries)
+        if ((int)insertPath[level]->children->size() > this->maxEntries())
         {
           this->_split(insertPath, level);
           level--;
@@ -406,94 +1096,160 @@ namespace rbush
     };
 
 
-    void _adjustParentBBoxes(Bbox &bbox, std::vector<TreeNode<T> *>& path, int level)
+    void _adjustParentBBoxes(Bbox &bbox, Stack& path, int level)
     {
       // adjust bboxes along the given tree path
       for (int i = level; i >= 0; i--)
       {
-        extend(path[i]->bbox, bbox);
+        bboxExtend(path[i]->bbox, bbox);
       }
     };
 
 
-    void _splitRoot(TreeNode<T> *node, TreeNode<T> *newNode)
+    void _splitRoot(TreeBranch<T> *node, TreeBranch<T> *newNode)
     {
-      std::cerr << "_splitRoot" << "\n";
       // split root node
-      auto children = new std::vector<TreeNode<T> *>();
-      children->push_back(node);
-      children->push_back(newNode);
-      this->rootNode = createNode(children);
+      this->rootNode = createNode(this->newChildren());
+      addChild(this->rootNode, node);
+      addChild(this->rootNode, newNode);
       this->rootNode->height = node->height + 1;
       this->rootNode->leaf = false;
       calcBBox(*this->rootNode);
     };
 
 
-    TreeNode<T> *_build(std::vector<TreeNode<T> *>& items, int left, int right, int height)
+    TreeBranch<T> *_build(std::vector<TreeNode<T> *>& items, std::size_t left, std::size_t right, int height)
     {
-      int N = right - left + 1;
-      int M = this->_maxEntries;
-
-      if (N <= M)
+      if (right - left + 1 <= (std::size_t)this->maxEntries())
       {
         // reached leaf level; return leaf
-        auto childrens = new std::vector<TreeNode<T> *>();
+        auto childrens = this->newChildren();
         childrens->insert(childrens->end(), items.begin() + left, items.begin() + right + 1); //items.slice(left, right + 1)
         auto node = createNode(childrens);
+        for (auto& child: *childrens)
+          child->parent = node;
         calcBBox(*node);
         return node;
       }
 
-      if (!height)
-      {
-        // target height of the bulk-loaded tree
-        height = std::ceil(std::log(N) / std::log(M));
-
-        // target number of root entries to maximize storage utilization
-        M = std::ceil(N / std::pow(M, height - 1));
-      }
-
-      auto node = createNode(new std::vector<TreeNode<T> *>());
+      // split the items into mostly square tiles and pack each one recursively
+      auto node = createNode(this->newChildren());
       node->leaf = false;
-      node->height = height;
-
-      // split the items into M mostly square tiles
+      node->height = omtTiles(items, left, right, this->maxEntries(), height, compareNodeMinX, compareNodeMinY,
+        [this, &items, node](std::size_t l, std::size_t r, int h) { addChild(node, this->_build(items, l, r, h)); });
+      calcBBox(*node);
 
-      int N2 = std::ceil(N / M);
-      int N1 = N2 * std::ceil(std::sqrt(M));
-      
-      multiSelect(items, left, right, N1, [](const TreeNode<T> *a, const TreeNode<T> *b) { return a->bbox.minX - b->bbox.minX; });
+      return node;
+    };
 
-      for (int i = left; i <= right; i += N1)
-      {
-        int right2 = std::min(i + N1 - 1, right);
+    // visit items crossed by the line from p0 to p1 (up to tMax) by increasing entry parameter
+    template <class Visitor>
+    void _searchLine(const Point& p0, const Point& p1, double tMax, Visitor& visitor)
+    {
+      // nodes and items waiting to be visited, nearest entry point first
+      typedef std::pair<double, TreeNode<T> *> Entry;
+      std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+      std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> items;
 
-        multiSelect(items, i, right2, N2, [](const TreeNode<T> *a, const TreeNode<T> *b) { return a->bbox.minY - b->bbox.minY; });
+      double t;
+      if (!this->rootNode->children->size() || !lineEnters(p0, p1, tMax, this->rootNode->bbox, t))
+        return;
 
-        for (int j = i; j <= right2; j += N2)
+      queue.push(Entry(t, this->rootNode));
+      while (!queue.empty() || !items.empty())
+      {
+        if (!items.empty() && (queue.empty() || items.top().first <= queue.top().first))
         {
-          int right3 = std::min(j + N2 - 1, right2);
+          // no pending node can hold an item entered before this one
+          auto item = items.top();
+          items.pop();
+          if (!visitor(item.second, item.first))
+            return;
+          continue;
+        }
 
-          // pack each entry recursively
-          node->children->push_back(this->_build(items, j, right3, height - 1));
+        auto node = asBranch(queue.top().second);
+        queue.pop();
+        for (auto& child: *node->children)
+        {
+          if (lineEnters(p0, p1, tMax, child->bbox, t))
+          {
+            if (node->leaf)
+              items.push(Entry(t, child));
+            else
+              queue.push(Entry(t, child));
+          }
         }
       }
+    };
 
-      calcBBox(*node);
+    // pairs inside a subtree: pairs of children found by plane sweep (joined with each other
+    // when they are nodes), then pairs inside each child subtree
+    template <class Visitor>
+    bool _selfJoin(const TreeBranch<T> *node, Visitor& visitor)
+    {
+      std::vector<TreeNode<T> *> children;
+      sweepCandidates(node, node->bbox, children);
+      bool leaf = node->leaf;
+      if (!selfSweep(children, [&](TreeNode<T> *a, TreeNode<T> *b) { return leaf ? (bool)visitor(a, b) : joinNodes(asBranch(a), asBranch(b), visitor); }))
+        return false;
+      if (!leaf)
+        for (auto& child: children)
+          if (!this->_selfJoin(asBranch(child), visitor))
+            return false;
+      return true;
+    };
 
-      return node;
+    // bbox padded by the loose margin, and stretched by the loose velocity factor times displacement
+    // in the direction of the move
+    Bbox _loosen(const Bbox& bbox, const Point& displacement) const
+    {
+      auto loose = bbox;
+      loose.minX -= this->_looseMargin;
+      loose.minY -= this->_looseMargin;
+      loose.maxX += this->_looseMargin;
+      loose.maxY += this->_looseMargin;
+      auto dx = displacement.x * this->_looseVelocity;
+      auto dy = displacement.y * this->_looseVelocity;
+      (dx < 0 ? loose.minX : loose.maxX) += dx;
+      (dy < 0 ? loose.minY : loose.maxY) += dy;
+      return loose;
     };
 
-    void _all(TreeNode<T> *node, std::vector<TreeNode<T> *>& result)
+    bool _isLoose() const { return this->_looseMargin > 0 || this->_looseVelocity > 0; };
+
+    // Depth-first traversal shared by the queries. match(child, item) tells what to do with each
+    // child, the root first: Skip it, Descend into it (a node), or Take it, giving an item to
+    // visit(item) and a node whose items are all wanted to take(node). Stops as soon as visit or
+    // take returns false, and returns false then.
+    template <class Classify, class Visit, class TakeNode>
+    bool _visit(Classify match, Visit visit, TakeNode take) const
     {
-      std::vector<TreeNode<T> *> nodesToSearch;
+      auto node = this->rootNode;
+      auto rootMatch = match(node, false);
+      if (rootMatch != Descend)
+        return rootMatch == Skip || take(node);
+
+      Stack nodesToSearch;
       while (node)
       {
         if (node->leaf)
-          result.insert(result.end(), node->children->begin(), node->children->end());
+        {
+          for (auto& child: *node->children)
+            if (match(child, true) == Take && !visit(child))
+              return false;
+        }
         else
-          nodesToSearch.insert(nodesToSearch.end(), node->children->begin(), node->children->end());
+        {
+          for (auto& child: *node->children)
+          {
+            auto childMatch = match(child, false);
+            if (childMatch == Descend)
+              nodesToSearch.push_back(asBranch(child));
+            else if (childMatch == Take && !take(asBranch(child)))
+              return false;
+          }
+        }
         if (!nodesToSearch.empty())
         {
           node = nodesToSearch.back();
@@ -504,7 +1260,235 @@ namespace rbush
           node = NULL;
         }
       }
-      //return result;
+      return true;
+    };
+
+    // _visit of the items whose match(child, item) takes them, nodes included when taken whole
+    template <class Classify, class Visitor>
+    bool _visitItems(Classify match, Visitor& visitor) const
+    {
+      return this->_visit(match, visitor, [&visitor, this](TreeBranch<T> *node) { return this->_each(node, visitor); });
+    };
+
+    // combination under Monoid of value(item) over the items intersecting bbox; subtrees inside
+    // bbox contribute their cached summary(node) without being visited
+    template <class Monoid, class Value, class Summary>
+    typename Monoid::value_type _fold(const Bbox& bbox, Value value, Summary summary) const
+    {
+      auto result = Monoid::identity();
+      this->_visit(
+        [&bbox](const TreeNode<T> *child, bool item) -> Match { return !bboxIntersects(bbox, child->bbox) ? Skip : item || bboxContains(bbox, child->bbox) ? Take : Descend; },
+        [&](TreeNode<T> *item) { result = Monoid::combine(result, value(item)); return true; },
+        [&](TreeBranch<T> *node) { result = Monoid::combine(result, summary(node)); return true; });
+      return result;
+    };
+
+    // visit the items whose bbox holds the point (x, y); stops as soon as visitor returns false.
+    // A point query never contains a node, so unlike _search there is no bulk accept test.
+    template <class Visitor>
+    bool _searchPoint(double x, double y, Visitor& visitor) const
+    {
+      return this->_visitItems([x, y](const TreeNode<T> *child, bool item) -> Match { return !holdsPoint(child->bbox, x, y) ? Skip : item ? Take : Descend; }, visitor);
+    };
+
+    // visit the items whose bbox lies entirely within bbox; subtrees inside bbox are taken whole
+    template <class Visitor>
+    bool _searchWithin(const Bbox& bbox, Visitor& visitor) const
+    {
+      return this->_visitItems([&bbox](const TreeNode<T> *child, bool item) -> Match
+      {
+        if (bboxContains(bbox, child->bbox))
+          return Take;
+        return !item && bboxIntersects(bbox, child->bbox) ? Descend : Skip;
+      }, visitor);
+    };
+
+    // visit the items whose bbox contains bbox; only the nodes containing bbox can hold one
+    template <class Visitor>
+    bool _searchContaining(const Bbox& bbox, Visitor& visitor) const
+    {
+      return this->_visitItems([&bbox](const TreeNode<T> *child, bool item) -> Match
+      {
+        if (!bboxContains(child->bbox, bbox))
+          return Skip;
+        return item ? Take : Descend;
+      }, visitor);
+    };
+
+    // visit the items whose exactBbox(item) intersects bbox; stops as soon as visitor returns false
+    template <class ExactBbox, class Visitor>
+    bool _search(const Bbox& bbox, ExactBbox exactBbox, Visitor& visitor) const
+    {
+      return this->_visitItems([&bbox, &exactBbox](const TreeNode<T> *child, bool item) -> Match
+      {
+        if (!bboxIntersects(bbox, child->bbox))
+          return Skip;
+        if (item)
+          return bboxIntersects(bbox, exactBbox(child)) ? Take : Skip;
+        return bboxContains(bbox, child->bbox) ? Take : Descend;
+      }, visitor);
+    };
+
+    // after a removal from node: drop the nodes left empty and tighten the bboxes up to the root
+    void _condense(TreeBranch<T> *node)
+    {
+      while (node)
+      {
+        auto parent = node->parent;
+        if (node->children->empty() && parent)
+        {
+          auto siblings = parent->children;
+          siblings->erase(std::find(siblings->begin(), siblings->end(), node));
+          this->_deleteNode(node);
+        }
+        else if (node->children->empty())
+        {
+          // the tree is empty again
+          node->leaf = true;
+          node->height = 1;
+          calcBBox(*node);
+        }
+        else
+          calcBBox(*node);
+        node = parent;
+      }
+    };
+
+    // true if node is a node of this tree
+    bool _holds(const TreeBranch<T> *node) const
+    {
+      while (node->parent)
+        node = node->parent;
+      return node == this->rootNode;
+    };
+
+    // free the nodes of a subtree; items belong to the caller
+    void _deleteNode(TreeBranch<T> *node)
+    {
+      if (node == this->_lastLeaf)
+        this->_lastLeaf = NULL;
+      if (!node->leaf)
+        for (auto& child: *node->children)
+          this->_deleteNode(asBranch(child));
+      else
+      {
+        // detach the items still pointing to this leaf (adopted ones already point elsewhere), so that
+        // remove() and insertion hints don't walk freed nodes
+        for (auto& child: *node->children)
+          if (child->parent == node)
+            child->parent = NULL;
+      }
+      node->children->~Children();
+      this->resource->deallocate(node->children, sizeof(Children), alignof(Children));
+      static_cast<Node *>(node)->~Node();
+      this->resource->deallocate(node, sizeof(Node), alignof(Node));
+    };
+
+    void _all(const TreeBranch<T> *node, std::vector<TreeNode<T> *>& result) const
+    {
+      if (node->leaf)
+      {
+        result.insert(result.end(), node->children->begin(), node->children->end());
+        return;
+      }
+      for (auto& child: *node->children)
+        this->_all(asBranch(child), result);
+    };
+
+    // visit all the items of a subtree; stops as soon as visitor returns false
+    template <class Visitor>
+    bool _each(const TreeBranch<T> *node, Visitor& visitor) const
+    {
+      if (node->leaf)
+      {
+        for (auto& child: *node->children)
+          if (!visitor(child))
+            return false;
+        return true;
+      }
+      for (auto& child: *node->children)
+        if (!this->_each(asBranch(child), visitor))
+          return false;
+      return true;
+    };
+
+    void _quality(const TreeBranch<T> *node, TreeQuality& quality, double& area, double& overlap) const
+    {
+      quality.nodes++;
+      quality.fill += node->children->size();
+      quality.nodesVisited += bboxArea(node->bbox);
+      if (node->leaf)
+        return;
+      auto& children = *node->children;
+      for (std::size_t i = 0; i < children.size(); i++)
+      {
+        area += bboxArea(children[i]->bbox);
+        for (std::size_t j = i + 1; j < children.size(); j++)
+          overlap += intersectionArea(children[i]->bbox, children[j]->bbox);
+        this->_quality(asBranch(children[i]), quality, area, overlap);
+      }
+    };
+
+    void _log(TreeNode<T> *item, bool inTree)
+    {
+      if (this->_rebuild)
+        this->_rebuild->dirty[item] = inTree;
+    };
+
+    // before a change of the tree: swap in a finished rebuild, or check whether one is needed
+    void _maintain()
+    {
+      if (this->_rebuild)
+      {
+        if (this->_rebuild->done)
+          this->finishRebuild();
+        return;
+      }
+      if (this->_rebuildFactor > 0 && ++this->_mutations >= std::max<std::size_t>(1024, this->size() / 8))
+      {
+        this->_mutations = 0;
+        if (this->quality().nodesVisited > this->_builtNodesVisited * this->_rebuildFactor)
+          this->startRebuild();
+      }
+    };
+
+    // copy of the subtree of the rebuilt tree under node, with the items back in place of their
+    // proxies; dirty items are left out, and the leaves that lost some are kept in thinned
+    TreeBranch<T> *_adopt(const TreeBranch<T> *node, Stack& thinned)
+    {
+      auto copy = createNode(this->newChildren());
+      copy->height = node->height;
+      copy->leaf = node->leaf;
+      for (auto& child: *node->children)
+      {
+        if (node->leaf)
+        {
+          auto item = this->_rebuild->items[child - this->_rebuild->proxies.data()];
+          if (this->_rebuild->dirty.count(item))
+            continue;
+          addChild(copy, item);
+        }
+        else
+          addChild(copy, this->_adopt(asBranch(child), thinned));
+      }
+      if (copy->children->size() < node->children->size() && node->leaf)
+        thinned.push_back(copy);
+      calcBBox(*copy);
+      return copy;
+    };
+
+    // insert item with the bbox exact (padded when loose) from the lowest ancestor of leaf
+    // containing it, from the root if leaf is NULL
+    void _insertNear(TreeNode<T> *item, const Bbox& exact, TreeBranch<T> *leaf)
+    {
+      this->_log(item, true);
+      item->bbox = this->_isLoose() ? this->_loosen(exact, { 0, 0 }) : exact;
+
+      auto start = leaf;
+      while (start && !bboxContains(start->bbox, item->bbox))
+        start = start->parent;
+      this->_insert(item, this->rootNode->height - 1, false, start);
+      this->_lastLeaf = item->parent;
     };
 
     void load(std::vector<TreeNode<T> *> &data)
@@ -512,12 +1496,13 @@ namespace rbush
       if (!data.size())
         return;
 
-      if ((int)data.size() < this->_minEntries)
+      if ((int)data.size() < this->minEntries())
       {
         for (auto& item: data)
         {
           this->insert(item);
         }
+        return;
       }
 
       // recursively build the tree with the given data from scratch using OMT algorithm
@@ -528,6 +1513,7 @@ namespace rbush
       if (!this->rootNode->children->size())
       {
         // save as is if tree is empty
+        this->_deleteNode(this->rootNode);
         this->rootNode = node;
       }
       else if (this->rootNode->height == node->height)
@@ -549,26 +1535,299 @@ namespace rbush
       }
     };
 
+    void _init(std::vector<TreeNode<T> *> &data, int maxEntries, pmr::memory_resource *resource)
+    {
+      this->_maxEntries = MaxEntries ? StaticMaxEntries : std::max(4, maxEntries);
+      this->_minEntries = MaxEntries ? StaticMinEntries : std::max(2, (int)std::ceil(this->_maxEntries * 0.4));
+      this->resource = resource;
+      this->_lastLeaf = NULL;
+      this->_looseMargin = 0;
+      this->_looseVelocity = 0;
+      this->_rebuild = NULL;
+      this->_rebuildFactor = 0;
+      this->_mutations = 0;
+      this->_releaseWithResource = false;
+      this->rootNode = createNode(this->newChildren());
+      load(data);
+      this->_builtNodesVisited = data.empty() ? 0 : this->quality().nodesVisited;
+    };
+
 
 
   public:
   
-    const TreeNode<T> *root() const { return rootNode; };
+    const TreeBranch<T> *root() const { return rootNode; };
   
-    RBush(std::vector<TreeNode<T> *> &data, int maxEntries = 9)
+    // nodes and child arrays are allocated from resource, which must outlive the tree;
+    // RBush<T, Dynamic> gets the default capacity of 9
+    RBush(std::vector<TreeNode<T> *> &data, pmr::memory_resource *resource = pmr::get_default_resource())
     {
-      this->_maxEntries = std::max(4, maxEntries);
-      this->_minEntries = std::max(2, (int)std::ceil(this->_maxEntries * 0.4));
-      this->rootNode = createNode(new std::vector<TreeNode<T> *>());
-      load(data);
+      this->_init(data, 9, resource);
+    };
+
+    // RBush<T, Dynamic> only: node capacity chosen at run time
+    RBush(std::vector<TreeNode<T> *> &data, int maxEntries, pmr::memory_resource *resource = pmr::get_default_resource())
+    {
+      static_assert(MaxEntries == Dynamic, "the capacity of RBush<T, MaxEntries> is its template argument; use RBush<T, Dynamic> for a run-time capacity");
+      this->_init(data, maxEntries, resource);
     };
 
+    RBush(const RBush&) = delete;
+    RBush& operator=(const RBush&) = delete;
+
+    // the items still in the tree are detached (parent reset to NULL), so they must outlive it
     ~RBush()
     {
-      // TODO
-      delete rootNode;
+      if (this->_rebuild)
+      {
+        this->_rebuild->worker.join();
+        delete this->_rebuild->fresh;
+        delete this->_rebuild;
+      }
+      if (!this->_releaseWithResource)
+        this->_deleteNode(this->rootNode);
     };
+
+    // For a resource released as a whole after the tree (a monotonic arena): the destructor then
+    // leaves the nodes to the resource instead of walking the tree to free them one by one. The
+    // items keep their parent pointers into the released nodes, so they must not be given to
+    // remove(), update() or insert(item, hint) of another tree afterwards.
+    void releaseWithResource(bool release = true)
+    {
+      this->_releaseWithResource = release;
+    };
+
+    pmr::memory_resource *memoryResource() const { return this->resource; };
     
+    // with loose bboxes, item->bbox is taken as the exact bbox and stored padded; an item that was
+    // removed holds its padded bbox, so give it back with insert(item, exact) or update(item, exact)
+    void insert(TreeNode<T> *item)
+    {
+      this->insert(item, NULL);
+    };
+
+    void insert(TreeNode<T> *item, const Bbox& exact)
+    {
+      this->_maintain();
+      this->_insertNear(item, exact, NULL);
+    };
+
+    // Insert item near hint, an item of this tree: the subtree is chosen from the lowest ancestor
+    // of the leaf of hint that contains item, instead of from the root, which saves most of the
+    // descent for spatially coherent streams (GPS tracks, scan lines). A NULL hint, or one that is
+    // not in this tree, starts from the root.
+    void insert(TreeNode<T> *item, const TreeNode<T> *hint)
+    {
+      this->_maintain();
+      auto leaf = hint && hint->parent && this->_holds(hint->parent) ? hint->parent : NULL;
+      this->_insertNear(item, item->bbox, leaf);
+    };
+
+    // insert item near the item inserted last
+    void insertNext(TreeNode<T> *item)
+    {
+      this->_maintain();
+      this->_insertNear(item, item->bbox, this->_lastLeaf);
+    };
+
+    // Store the bboxes of items given to insert() and update() padded by margin on each side, and
+    // stretched by velocityFactor times the displacement given to update(), so that small moves
+    // need no change in the tree. item->bbox then holds the padded bbox: keep the exact one with
+    // the payload and give it to searchExact(bbox, exactBbox) to refine results.
+    void setLooseness(double margin, double velocityFactor = 0)
+    {
+      this->_looseMargin = std::max(0.0, margin);
+      this->_looseVelocity = std::max(0.0, velocityFactor);
+    };
+
+    // remove item from the tree; returns false if it isn't in this tree
+    bool remove(TreeNode<T> *item)
+    {
+      this->_maintain();
+      auto leaf = item->parent;
+      if (!leaf || !this->_holds(leaf))
+        return false;
+      auto children = leaf->children;
+      auto i = std::find(children->begin(), children->end(), item);
+      if (i == children->end())
+        return false;
+      children->erase(i);
+      item->parent = NULL;
+      this->_condense(leaf);
+      this->_log(item, false);
+      return true;
+    };
+
+    // move item, which must be in this tree or in none, to bbox. The item stays in place when its
+    // leaf still contains the new bbox; otherwise it moves to the best leaf under its nearest
+    // ancestor that contains the new bbox (a sibling leaf first), and only goes through the root
+    // when no ancestor does.
+    //
+    // With loose bboxes, bbox is the exact bbox of the item and displacement its last move: an item
+    // whose stored bbox still contains bbox is left untouched, otherwise it is stored again padded.
+    void update(TreeNode<T> *item, const Bbox& exact, const Point& displacement = { 0, 0 })
+    {
+      this->_maintain();
+      auto leaf = item->parent;
+      if (leaf && this->_isLoose() && bboxContains(item->bbox, exact))
+        return;
+      this->_log(item, true);
+
+      auto bbox = this->_isLoose() ? this->_loosen(exact, displacement) : exact;
+      item->bbox = bbox;
+      if (!leaf)
+      {
+        this->_insert(item, this->rootNode->height - 1, false);
+        return;
+      }
+      if (bboxContains(leaf->bbox, bbox))
+        return;
+
+      auto ancestor = leaf->parent;
+      while (ancestor && !bboxContains(ancestor->bbox, bbox))
+        ancestor = ancestor->parent;
+
+      // the old leaf is condensed only after the insertion so that ancestor stays alive
+      auto children = leaf->children;
+      children->erase(std::find(children->begin(), children->end(), item));
+      for (auto node = leaf; node; node = node->parent)
+      {
+        node->count--;
+        Aggregates::calc(*node);
+      }
+      this->_insert(item, this->rootNode->height - 1, false, ancestor);
+      if (item->parent != leaf)
+        this->_condense(leaf);
+    };
+
+    // number of items intersecting bbox; subtrees inside bbox count as a whole from their cached
+    // item count, so the cost depends on the nodes crossed by the border of bbox, not on the result
+    std::size_t count(const Bbox& bbox) const
+    {
+      return this->_fold<CountMonoid>(bbox, [](const TreeNode<T> *) { return (std::size_t)1; }, [](const TreeBranch<T> *node) { return node->count; });
+    };
+
+    std::size_t size() const { return this->rootNode->count; };
+
+    // combination of the aggregate values of the items intersecting bbox; as with count(), subtrees
+    // inside bbox contribute their cached aggregate without being visited
+    template <class A = Aggregate>
+    typename A::value_type aggregate(const Bbox& bbox) const
+    {
+      return this->_fold<A>(bbox, [](const TreeNode<T> *item) { return A::value(item); }, [](const TreeBranch<T> *node) { return Aggregates::of(node); });
+    };
+
+    // to be called after a change of the aggregate value of an item of the tree
+    void refresh(TreeNode<T> *item)
+    {
+      for (auto node = item->parent; node; node = node->parent)
+        Aggregates::calc(*node);
+    };
+
+    // visit the items intersecting bbox whose aggregate value passes filter; subtrees whose
+    // aggregate fails it are skipped as a whole, so the aggregate must be a summary for which a
+    // subtree fails whenever all its items do (see MaskSummary and RangeSummary).
+    // Stops as soon as visitor returns false.
+    template <class Filter, class Visitor, class A = Aggregate>
+    void searchWhere(const Bbox& bbox, Filter filter, Visitor visitor) const
+    {
+      this->_visit([&bbox, &filter](const TreeNode<T> *child, bool item) -> Match
+      {
+        if (!bboxIntersects(bbox, child->bbox))
+          return Skip;
+        if (item)
+          return filter(A::value(child)) ? Take : Skip;
+        return filter(Aggregates::of(child)) ? Descend : Skip;
+      }, visitor, [](TreeBranch<T> *) { return true; });
+    };
+
+    template <class Filter>
+    std::vector<TreeNode<T> *> *searchWhere(const Bbox& bbox, Filter filter) const
+    {
+      auto result = new std::vector<TreeNode<T> *>();
+      this->searchWhere(bbox, filter, [result](TreeNode<T> *item) { result->push_back(item); return true; });
+      return result;
+    };
+
+    TreeQuality quality() const
+    {
+      TreeQuality quality = { 0, 0, 0, 0 };
+      double area = 0;
+      double overlap = 0;
+      this->_quality(this->rootNode, quality, area, overlap);
+      quality.overlap = area > 0 ? overlap / area : 0;
+      quality.fill /= quality.nodes * (double)this->maxEntries();
+      auto rootArea = bboxArea(this->rootNode->bbox);
+      quality.nodesVisited = rootArea > 0 ? quality.nodesVisited / rootArea : quality.nodes;
+      return quality;
+    };
+
+    // Rebuild the tree in the background once quality().nodesVisited exceeds factor times its value
+    // after the last bulk load (checked every size() / 8 changes, and at least 1024; a tree never
+    // bulk loaded is rebuilt at the first check); 0 turns automatic rebuilds off.
+    void setAutoRebuild(double factor)
+    {
+      this->_rebuildFactor = std::max(0.0, factor);
+    };
+
+    // Start bulk loading the current items into a fresh tree on a worker thread; returns false if
+    // a rebuild is already running. The tree stays fully usable meanwhile: the worker only reads
+    // a snapshot of the bboxes, and the changes made in the meantime are replayed when the fresh
+    // tree is swapped in by finishRebuild(), or by the first change after the worker is done.
+    bool startRebuild()
+    {
+      if (this->_rebuild)
+        return false;
+      auto rebuild = new Rebuild();
+      this->_all(this->rootNode, rebuild->items);
+      rebuild->proxies.resize(rebuild->items.size());
+      for (std::size_t i = 0; i < rebuild->items.size(); i++)
+        rebuild->proxies[i].bbox = rebuild->items[i]->bbox;
+      rebuild->fresh = NULL;
+      rebuild->done = false;
+      int maxEntries = this->maxEntries();
+      rebuild->worker = std::thread([rebuild, maxEntries]()
+      {
+        std::vector<TreeNode<T> *> proxies;
+        proxies.reserve(rebuild->proxies.size());
+        for (auto& proxy: rebuild->proxies)
+          proxies.push_back(&proxy);
+        rebuild->fresh = new RBush<T, Dynamic>(proxies, maxEntries, pmr::new_delete_resource());
+        rebuild->done = true;
+      });
+      this->_rebuild = rebuild;
+      return true;
+    };
+
+    bool rebuilding() const { return this->_rebuild != NULL; };
+
+    // wait for the running rebuild, if any, and swap its tree in
+    void finishRebuild()
+    {
+      auto rebuild = this->_rebuild;
+      if (!rebuild)
+        return;
+      rebuild->worker.join();
+
+      // copy the fresh tree into this tree's resource, then drop the nodes left empty
+      Stack thinned;
+      auto oldRoot = this->rootNode;
+      this->rootNode = this->_adopt(rebuild->fresh->root(), thinned);
+      for (auto& leaf: thinned)
+        this->_condense(leaf);
+      delete rebuild->fresh;
+
+      // replay the changes made during the rebuild
+      for (auto& change: rebuild->dirty)
+        if (change.second)
+          this->_insert(change.first, this->rootNode->height - 1, false);
+
+      this->_deleteNode(oldRoot);
+      this->_rebuild = NULL;
+      delete rebuild;
+      this->_builtNodesVisited = this->quality().nodesVisited;
+    };
+
     std::vector<TreeNode<T> *> *all()
     {
       auto result = new std::vector<TreeNode<T> *>();
@@ -578,42 +1837,402 @@ namespace rbush
     
     std::vector<TreeNode<T> *> *search(const Bbox& bbox)
     {
-      auto node = this->rootNode;
       auto result = new std::vector<TreeNode<T> *>();
+      this->search(bbox, [result](TreeNode<T> *item) { result->push_back(item); return true; });
+      return result;
+    };
 
-      if (!intersects(bbox, node->bbox))
-        return result;
+    // visit the items intersecting bbox; stops as soon as visitor returns false
+    template <class Visitor>
+    void search(const Bbox& bbox, Visitor visitor)
+    {
+      this->_search(bbox, [](const TreeNode<T> *item) -> const Bbox& { return item->bbox; }, visitor);
+    };
 
-      std::vector<TreeNode<T> *> nodesToSearch;
-      while (node)
+    // Stabbing query: items whose bbox holds the point (x, y), the same as search({ x, y, x, y })
+    // with a cheaper test per child
+    std::vector<TreeNode<T> *> *searchPoint(double x, double y) const
+    {
+      auto result = new std::vector<TreeNode<T> *>();
+      auto visitor = [result](TreeNode<T> *item) { result->push_back(item); return true; };
+      this->_searchPoint(x, y, visitor);
+      return result;
+    };
+
+    // visit the items whose bbox holds (x, y); stops as soon as visitor returns false
+    template <class Visitor>
+    void searchPoint(double x, double y, Visitor visitor) const
+    {
+      this->_searchPoint(x, y, visitor);
+    };
+
+    // first item found whose bbox holds (x, y) and accepted by accept(item), NULL if none;
+    // the search stops at that item (e.g. the first polygon actually containing the point)
+    template <class Accept>
+    TreeNode<T> *findPoint(double x, double y, Accept accept) const
+    {
+      TreeNode<T> *found = NULL;
+      auto visitor = [&](TreeNode<T> *item) { if (!accept(item)) return true; found = item; return false; };
+      this->_searchPoint(x, y, visitor);
+      return found;
+    };
+
+    // items whose bbox lies entirely within bbox
+    std::vector<TreeNode<T> *> *searchWithin(const Bbox& bbox)
+    {
+      auto result = new std::vector<TreeNode<T> *>();
+      auto visitor = [result](TreeNode<T> *item) { result->push_back(item); return true; };
+      this->_searchWithin(bbox, visitor);
+      return result;
+    };
+
+    template <class Visitor>
+    void searchWithin(const Bbox& bbox, Visitor visitor)
+    {
+      this->_searchWithin(bbox, visitor);
+    };
+
+    // items whose bbox contains bbox, e.g. the candidate admin areas around a feature; the descent
+    // follows only the nodes containing bbox, which are few even for a large query box
+    std::vector<TreeNode<T> *> *searchContaining(const Bbox& bbox)
+    {
+      auto result = new std::vector<TreeNode<T> *>();
+      auto visitor = [result](TreeNode<T> *item) { result->push_back(item); return true; };
+      this->_searchContaining(bbox, visitor);
+      return result;
+    };
+
+    template <class Visitor>
+    void searchContaining(const Bbox& bbox, Visitor visitor)
+    {
+      this->_searchContaining(bbox, visitor);
+    };
+
+    // Lazy search: yields the items intersecting bbox one at a time or page by page, keeping only
+    // the stack of nodes still to visit, so memory stays bounded by the tree height whatever the
+    // size of the result. A cursor can be paused and resumed at will, but is invalidated by any
+    // change of the tree.
+    class Cursor
+    {
+      struct Pending
       {
-        for (auto& child: *node->children)
+        TreeBranch<T> *node;
+        bool inside;   // node bbox inside the query: no more tests below it
+      };
+
+      Bbox bbox;
+      TreeBranch<T> *node;
+      std::size_t index;
+      bool inside;
+      std::vector<Pending> nodesToSearch;
+
+    public:
+      Cursor(const TreeBranch<T> *root, const Bbox& bbox)
+        : bbox(bbox), node(NULL), index(0), inside(false)
+      {
+        if (bboxIntersects(bbox, root->bbox))
+        {
+          this->node = const_cast<TreeBranch<T> *>(root);
+          this->inside = bboxContains(bbox, root->bbox);
+        }
+      };
+
+      // next item, NULL once all were returned
+      TreeNode<T> *next()
+      {
+        while (this->node)
         {
-          if (intersects(bbox, child->bbox))
+          auto& children = *this->node->children;
+          while (this->index < children.size())
           {
-            if (node->leaf)
-              result->push_back(child);
-            else if (contains(bbox, child->bbox))
-              this->_all(child, *result);
-            else
-              nodesToSearch.push_back(child);
+            auto child = children[this->index++];
+            if (!this->inside && !bboxIntersects(this->bbox, child->bbox))
+              continue;
+            if (this->node->leaf)
+              return child;
+            this->nodesToSearch.push_back({ asBranch(child), this->inside || bboxContains(this->bbox, child->bbox) });
+          }
+          if (!this->nodesToSearch.empty())
+          {
+            this->node = this->nodesToSearch.back().node;
+            this->inside = this->nodesToSearch.back().inside;
+            this->index = 0;
+            this->nodesToSearch.pop_back();
+          }
+          else
+          {
+            this->node = NULL;
           }
         }
-        if (!nodesToSearch.empty())
+        return NULL;
+      };
+
+      // append up to n items to page; returns the number of items appended, less than n at the end
+      std::size_t fetch(std::vector<TreeNode<T> *>& page, std::size_t n)
+      {
+        std::size_t fetched = 0;
+        while (fetched < n)
         {
-          node = nodesToSearch.back();
-          nodesToSearch.pop_back();
+          auto item = this->next();
+          if (!item)
+            break;
+          page.push_back(item);
+          fetched++;
         }
-        else
+        return fetched;
+      };
+
+      // true once next() returned NULL
+      bool done() const { return !this->node; };
+    };
+
+    Cursor cursor(const Bbox& bbox) const
+    {
+      return Cursor(this->rootNode, bbox);
+    };
+
+    // Incremental nearest neighbours: yields the items by increasing distance of their bbox from
+    // (x, y), on demand. A single priority queue of nodes and items, keyed by their distance, is
+    // kept between calls, so stopping after any number of items costs no more than a knn query of
+    // that k, and going on never restarts the search. Like Cursor, it is invalidated by any change
+    // of the tree.
+    class Nearest
+    {
+      struct Entry
+      {
+        double dist;
+        TreeNode<T> *node;
+        bool item;
+      };
+
+      // top of the queue: nearest entry, items before nodes at the same distance
+      struct Farther
+      {
+        bool operator()(const Entry& a, const Entry& b) const
         {
-          node = NULL;
+          return a.dist > b.dist || (a.dist == b.dist && a.item < b.item);
+        };
+      };
+
+      double x;
+      double y;
+      double cosLat;
+      bool planar;
+      double last;
+      std::priority_queue<Entry, std::vector<Entry>, Farther> queue;
+
+      // squared distance in planar mode, haversine of the central angle otherwise
+      double _dist(const Bbox& bbox) const
+      {
+        return this->planar ? boxDistSq(this->x, this->y, bbox) : haverBoxDist(this->x, this->y, this->cosLat, bbox);
+      };
+
+    public:
+      Nearest(const TreeBranch<T> *root, double x, double y, Metric metric)
+        : x(x), y(y), cosLat(std::cos(y * DegToRad)), planar(metric == Metric::Planar), last(0)
+      {
+        if (!root->children->empty())
+          this->queue.push({ this->_dist(root->bbox), const_cast<TreeBranch<T> *>(root), false });
+      };
+
+      // next nearest item, NULL once all were returned
+      TreeNode<T> *next()
+      {
+        while (!this->queue.empty())
+        {
+          auto entry = this->queue.top();
+          this->queue.pop();
+          if (entry.item)
+          {
+            this->last = entry.dist;
+            return entry.node;
+          }
+          auto node = asBranch(entry.node);
+          for (auto& child: *node->children)
+            this->queue.push({ this->_dist(child->bbox), child, node->leaf });
         }
-      }
+        return NULL;
+      };
+
+      // distance of the item returned last by next(): euclidean, or in meters with Metric::Haversine
+      double distance() const
+      {
+        return this->planar ? std::sqrt(this->last) : 2 * std::asin(std::sqrt(std::min(this->last, 1.0))) * EarthRadius;
+      };
+
+      // true once next() returned NULL
+      bool done() const { return this->queue.empty(); };
+    };
+
+    // items by increasing distance from (x, y); with Metric::Haversine, x and y are a longitude
+    // and a latitude in degrees
+    Nearest nearest(double x, double y, Metric metric = Metric::Planar) const
+    {
+      return Nearest(this->rootNode, x, y, metric);
+    };
+
+    // search for a tree of loose bboxes: exactBbox(item) gives the exact bbox of an item, which is
+    // tested against bbox once the stored, padded bbox of the item intersects it
+    template <class ExactBbox>
+    std::vector<TreeNode<T> *> *searchExact(const Bbox& bbox, ExactBbox exactBbox)
+    {
+      auto result = new std::vector<TreeNode<T> *>();
+      auto visitor = [result](TreeNode<T> *item) { result->push_back(item); return true; };
+      this->_search(bbox, exactBbox, visitor);
       return result;
     };
-    
+
+    // items whose bbox is at distance <= r from (x, y); with Metric::Haversine, x and y are
+    // a longitude and a latitude in degrees and r is in meters
+    std::vector<TreeNode<T> *> *searchRadius(double x, double y, double r, Metric metric = Metric::Planar)
+    {
+      auto node = this->rootNode;
+      auto result = new std::vector<TreeNode<T> *>();
+
+      bool planar = metric == Metric::Planar;
+      double cosLat = std::cos(y * DegToRad);
+      // compare squared distances in planar mode, haversines of the central angle otherwise
+      double maxDist = planar ? r * r : haverSin(std::min(r / EarthRadius, M_PI));
+      auto dist = [&](const Bbox& bbox) { return planar ? boxDistSq(x, y, bbox) : haverBoxDist(x, y, cosLat, bbox); };
+
+      if (r < 0 || !node->children->size())
+        return result;
+
+      this->_visit([&](const TreeNode<T> *child, bool item) -> Match
+      {
+        if (dist(child->bbox) > maxDist)
+          return Skip;
+        return item || (planar && farBoxDistSq(x, y, child->bbox) <= maxDist) ? Take : Descend;
+      },
+      [result](TreeNode<T> *item) { result->push_back(item); return true; },
+      [result, this](TreeBranch<T> *node) { this->_all(node, *result); return true; });
+      return result;
+    };
+
+    // items whose bbox intersects polygon; Polygon is a sequence of rings of points such as geojson::Polygon.
+    // Subtrees are classified against a band index of the polygon edges: outside ones are pruned,
+    // inside ones are bulk-accepted, and only the straddling ones are descended into.
+    template <class Polygon>
+    std::vector<TreeNode<T> *> *searchPolygon(const Polygon& polygon)
+    {
+      auto result = new std::vector<TreeNode<T> *>();
+
+      PolygonEdgeIndex index(polygon);
+      if (index.empty())
+        return result;
+
+      this->_visit([&index](const TreeNode<T> *child, bool item) -> Match
+      {
+        if (!bboxIntersects(index.bbox(), child->bbox))
+          return Skip;
+        auto position = index.classify(child->bbox);
+        if (position == PolygonEdgeIndex::Outside)
+          return Skip;
+        return item || position == PolygonEdgeIndex::Inside ? Take : Descend;
+      },
+      [result](TreeNode<T> *item) { result->push_back(item); return true; },
+      [result, this](TreeBranch<T> *node) { this->_all(node, *result); return true; });
+      return result;
+    };
+
+    // visitor(a, b) is called once for each pair of distinct items whose bboxes intersect
+    // and returns false to stop the join
+    template <class Visitor>
+    void selfJoin(Visitor visitor)
+    {
+      if (!this->rootNode->children->empty())
+        this->_selfJoin(this->rootNode, visitor);
+    };
+
+    // visit items whose bbox is crossed by the segment [p0, p1], in order along the segment;
+    // visitor(item, t) gets the parameter t in [0, 1] at which the segment enters the item bbox
+    // and returns false to stop the search
+    template <class Visitor>
+    void searchSegment(const Point& p0, const Point& p1, Visitor visitor)
+    {
+      this->_searchLine(p0, p1, 1, visitor);
+    };
+
+    // same as searchSegment for the ray starting at origin and going through p
+    template <class Visitor>
+    void searchRay(const Point& origin, const Point& p, Visitor visitor)
+    {
+      this->_searchLine(origin, p, std::numeric_limits<double>::infinity(), visitor);
+    };
+
   };
 
+  template <class T, int MaxEntries, class Aggregate, class Split>
+  constexpr int RBush<T, MaxEntries, Aggregate, Split>::StaticMaxEntries;
+
+  template <class T, int MaxEntries, class Aggregate, class Split>
+  constexpr int RBush<T, MaxEntries, Aggregate, Split>::StaticMinEntries;
+
+  // spatial join: visitor(itemA, itemB) is called for each pair of items of treeA and treeB
+  // whose bboxes intersect, and returns false to stop the join
+  template <class A, int MA, class AA, class SA, class B, int MB, class AB, class SB, class Visitor>
+  void join(const RBush<A, MA, AA, SA>& treeA, const RBush<B, MB, AB, SB>& treeB, Visitor visitor)
+  {
+    auto a = treeA.root();
+    auto b = treeB.root();
+    if (a->children->empty() || b->children->empty() || !bboxIntersects(a->bbox, b->bbox))
+      return;
+    joinNodes(a, b, visitor);
+  }
+
+  // same as join, with the pairs of top-level nodes shared among threads (hardware concurrency if 0);
+  // visitor is called concurrently and must be thread-safe
+  template <class A, int MA, class AA, class SA, class B, int MB, class AB, class SB, class Visitor>
+  void joinParallel(const RBush<A, MA, AA, SA>& treeA, const RBush<B, MB, AB, SB>& treeB, Visitor visitor, unsigned threads = 0)
+  {
+    auto a = treeA.root();
+    auto b = treeB.root();
+    if (a->children->empty() || b->children->empty() || !bboxIntersects(a->bbox, b->bbox))
+      return;
+    if (a->leaf && b->leaf)
+    {
+      joinNodes(a, b, visitor);
+      return;
+    }
+
+    // expand the roots into pairs of intersecting nodes until there is enough work to share
+    if (!threads)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    typedef std::pair<TreeBranch<A> *, TreeBranch<B> *> Pair;
+    std::vector<Pair> pairs;
+    pairs.push_back(Pair(const_cast<TreeBranch<A> *>(a), const_cast<TreeBranch<B> *>(b)));
+    while (pairs.size() < 4 * threads)
+    {
+      std::vector<Pair> next;
+      for (auto& p: pairs)
+      {
+        if (p.first->leaf && p.second->leaf)
+          next.push_back(p);
+        else
+          joinChildren(p.first, p.second, [&](TreeNode<A> *ca, TreeNode<B> *cb) { next.push_back(Pair(asBranch(ca), asBranch(cb))); return true; });
+      }
+      bool expanded = next.size() != pairs.size();
+      pairs.swap(next);
+      if (!expanded)
+        break;
+    }
+
+    std::atomic<std::size_t> nextPair(0);
+    std::atomic<bool> stop(false);
+    auto worker = [&]()
+    {
+      auto stopping = [&](TreeNode<A> *ia, TreeNode<B> *ib) { if (stop || !visitor(ia, ib)) { stop = true; return false; } return true; };
+      for (auto i = nextPair++; i < pairs.size() && !stop; i = nextPair++)
+        joinNodes(pairs[i].first, pairs[i].second, stopping);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++)
+      workers.push_back(std::thread(worker));
+    worker();
+    for (auto& w: workers)
+      w.join();
+  }
+
 }
 
 
@@ -0,0 +1,423 @@
+//
+// Brute-force checks of the indexes, run by `make check`.
+//
+// Each check builds trees of random items, changes and queries them, and compares the results
+// with a linear scan of the items. After changes, the tree structure is verified as well:
+// parent links, node bboxes enclosing their children, leaves all at height 1 and cached item
+// counts. Prints the failed checks and exits with 1 if any.
+//
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+#include "RBush.hpp"
+#include "PagedRBush.hpp"
+
+
+typedef rbush::TreeNode<int> Item;
+typedef std::set<const Item *> ItemSet;
+
+static std::mt19937 generator(42);
+static int failures = 0;
+
+
+static void expect(bool ok, const std::string& what)
+{
+  if (ok)
+    return;
+  std::cout << "FAILED: " << what << "\n";
+  failures++;
+}
+
+static double uniform(double min, double max)
+{
+  return std::uniform_real_distribution<double>(min, max)(generator);
+}
+
+static rbush::Bbox randomBbox(double min, double max, double size)
+{
+  double x = uniform(min, max);
+  double y = uniform(min, max);
+  return { x, y, x + uniform(0, size), y + uniform(0, size) };
+}
+
+static std::vector<Item *> randomItems(int n, double size)
+{
+  std::vector<Item *> items;
+  for (int i = 0; i < n; i++)
+  {
+    auto item = new Item();
+    item->bbox = randomBbox(0, 100, size);
+    item->data = i;
+    items.push_back(item);
+  }
+  return items;
+}
+
+static ItemSet toSet(std::vector<Item *> *result)
+{
+  ItemSet set(result->begin(), result->end());
+  delete result;
+  return set;
+}
+
+static ItemSet bruteSearch(const std::vector<Item *>& items, const rbush::Bbox& bbox)
+{
+  ItemSet found;
+  for (auto item: items)
+    if (rbush::bboxIntersects(bbox, item->bbox))
+      found.insert(item);
+  return found;
+}
+
+// verify the subtree of node and add its items to count; returns false at the first broken invariant
+static bool validNode(const rbush::TreeBranch<int> *node, std::size_t& count)
+{
+  if (node->leaf != (node->height == 1))
+    return false;
+  std::size_t before = count;
+  for (auto child: *node->children)
+  {
+    if (child->parent != node || !rbush::bboxContains(node->bbox, child->bbox))
+      return false;
+    if (node->leaf)
+    {
+      count++;
+      continue;
+    }
+    auto branch = rbush::asBranch(child);
+    if (branch->height != node->height - 1 || branch->children->empty() || !validNode(branch, count))
+      return false;
+  }
+  return node->count == count - before;
+}
+
+static bool validTree(const rbush::TreeBranch<int> *root, std::size_t size)
+{
+  std::size_t count = 0;
+  return !root->parent && validNode(root, count) && count == size;
+}
+
+
+// update() moving items by small and large steps, then remove() of half and all the items
+static void checkRemoveUpdate()
+{
+  for (int n: { 0, 5, 50, 3000 })
+  {
+    auto name = "remove/update of " + std::to_string(n) + " items";
+    auto items = randomItems(n, 2);
+    auto loaded = items;
+    rbush::RBush<int> tree(loaded);
+
+    for (int step = 0; n && step < 20000; step++)
+    {
+      auto item = items[generator() % n];
+      double scale = step % 50 ? 1 : 30;
+      double dx = uniform(-scale, scale);
+      double dy = uniform(-scale, scale);
+      tree.update(item, { item->bbox.minX + dx, item->bbox.minY + dy, item->bbox.maxX + dx, item->bbox.maxY + dy });
+    }
+    expect(validTree(tree.root(), items.size()), name + ": tree after updates");
+    for (int q = 0; q < 100; q++)
+    {
+      auto bbox = randomBbox(-20, 120, 20);
+      expect(toSet(tree.search(bbox)) == bruteSearch(items, bbox), name + ": search after updates");
+    }
+
+    std::vector<Item *> kept;
+    for (std::size_t i = 0; i < items.size(); i++)
+    {
+      if (i % 2)
+      {
+        expect(tree.remove(items[i]), name + ": remove");
+        expect(!tree.remove(items[i]), name + ": remove twice");
+      }
+      else
+        kept.push_back(items[i]);
+    }
+    expect(validTree(tree.root(), kept.size()), name + ": tree after removing half");
+    expect(toSet(tree.all()) == ItemSet(kept.begin(), kept.end()), name + ": items after removing half");
+    for (auto item: kept)
+      expect(tree.remove(item), name + ": remove");
+    expect(validTree(tree.root(), 0), name + ": tree after removing all");
+
+    for (auto item: items)
+      tree.insert(item);
+    expect(validTree(tree.root(), items.size()), name + ": tree after inserting again");
+    for (auto item: items)
+    {
+      tree.remove(item);
+      delete item;
+    }
+  }
+
+  // the items of a destroyed tree are detached, and belong to no other tree
+  auto items = randomItems(100, 2);
+  {
+    auto loaded = items;
+    rbush::RBush<int> destroyed(loaded);
+  }
+  std::vector<Item *> none;
+  rbush::RBush<int> other(none);
+  for (auto item: items)
+    expect(!item->parent && !other.remove(item), "remove of an item of a destroyed tree");
+  for (auto item: items)
+    delete item;
+}
+
+// random inserts, removes and updates while background rebuilds run and are swapped in
+static void checkRebuild()
+{
+  for (bool automatic: { false, true })
+  {
+    auto name = std::string(automatic ? "automatic" : "manual") + " rebuild";
+    std::vector<Item *> none;
+    rbush::RBush<int> tree(none);
+    if (automatic)
+      tree.setAutoRebuild(1.2);
+
+    std::vector<Item *> items;
+    for (int step = 0; step < 30000; step++)
+    {
+      if (!automatic && step % 3000 == 0)
+        tree.startRebuild();
+      if (!automatic && step % 3000 == 1500 && generator() % 2)
+        tree.finishRebuild();
+
+      int op = generator() % 6;
+      if (op == 1 && !items.empty())
+      {
+        std::size_t i = generator() % items.size();
+        expect(tree.remove(items[i]), name + ": remove");
+        delete items[i];
+        items.erase(items.begin() + i);
+      }
+      else if (op == 2 && !items.empty())
+        tree.update(items[generator() % items.size()], randomBbox(0, 100, 1));
+      else
+      {
+        auto item = new Item();
+        item->bbox = randomBbox(0, 100, 3);
+        tree.insert(item);
+        items.push_back(item);
+      }
+    }
+    tree.finishRebuild();
+
+    expect(validTree(tree.root(), items.size()) && tree.size() == items.size(), name + ": tree");
+    for (int q = 0; q < 100; q++)
+    {
+      auto bbox = randomBbox(-10, 110, 40);
+      expect(toSet(tree.search(bbox)) == bruteSearch(items, bbox), name + ": search");
+    }
+    for (auto item: items)
+    {
+      expect(tree.remove(item), name + ": remove");
+      delete item;
+    }
+  }
+}
+
+// search, searchPoint, searchWithin and searchContaining of bulk-loaded trees, with their
+// visitors stopping early
+static void checkQueries()
+{
+  for (double size: { 2.0, 30.0 })
+  {
+    auto name = "queries on items of size " + std::to_string((int)size);
+    auto items = randomItems(20000, size);
+    auto loaded = items;
+    auto tree = new rbush::RBush<int>(loaded);
+    expect(validTree(tree->root(), items.size()), name + ": bulk-loaded tree");
+
+    for (int q = 0; q < 500; q++)
+    {
+      auto bbox = q % 7 ? randomBbox(-5, 100, q % 3 ? 5 : 60) : items[generator() % items.size()]->bbox;
+      ItemSet within, containing;
+      for (auto item: items)
+      {
+        if (rbush::bboxContains(bbox, item->bbox))
+          within.insert(item);
+        if (rbush::bboxContains(item->bbox, bbox))
+          containing.insert(item);
+      }
+      expect(toSet(tree->search(bbox)) == bruteSearch(items, bbox), name + ": search");
+      expect(toSet(tree->searchWithin(bbox)) == within, name + ": searchWithin");
+      expect(toSet(tree->searchContaining(bbox)) == containing, name + ": searchContaining");
+
+      std::size_t visited = 0;
+      tree->searchWithin(bbox, [&visited](Item *) { return ++visited < 3; });
+      expect(visited == std::min<std::size_t>(3, within.size()), name + ": searchWithin stopped by its visitor");
+      visited = 0;
+      tree->search(bbox, [&visited](Item *) { return ++visited < 2; });
+      expect(visited == std::min<std::size_t>(2, bruteSearch(items, bbox).size()), name + ": search stopped by its visitor");
+
+      double x = uniform(-5, 105);
+      double y = uniform(-5, 105);
+      expect(toSet(tree->searchPoint(x, y)) == bruteSearch(items, { x, y, x, y }), name + ": searchPoint");
+    }
+
+    delete tree;
+    for (auto item: items)
+      delete item;
+  }
+}
+
+// nearest() yields every item once, by increasing distance, and the haversine distances never
+// decrease and agree with searchRadius
+static void checkNearest()
+{
+  auto items = randomItems(20000, 1);
+  auto loaded = items;
+  auto tree = new rbush::RBush<int>(loaded);
+  for (int q = 0; q < 200; q++)
+  {
+    double x = uniform(-10, 110);
+    double y = uniform(-10, 110);
+    std::vector<double> distances;
+    for (auto item: items)
+    {
+      auto& b = item->bbox;
+      double dx = std::max(0.0, std::max(b.minX - x, x - b.maxX));
+      double dy = std::max(0.0, std::max(b.minY - y, y - b.maxY));
+      distances.push_back(std::sqrt(dx * dx + dy * dy));
+    }
+    std::sort(distances.begin(), distances.end());
+
+    auto nearest = tree->nearest(x, y);
+    std::size_t k = q % 20 ? generator() % 200 : items.size();
+    ItemSet seen;
+    bool ordered = true;
+    for (std::size_t i = 0; i < k; i++)
+    {
+      auto item = nearest.next();
+      ordered = ordered && item && seen.insert(item).second && std::abs(nearest.distance() - distances[i]) < 1e-9;
+    }
+    expect(ordered, "nearest items by increasing distance");
+    if (k == items.size())
+      expect(!nearest.next() && nearest.done(), "nearest done after the last item");
+  }
+  delete tree;
+  for (auto item: items)
+    delete item;
+
+  // lng/lat items
+  items = randomItems(5000, 0.5);
+  for (auto item: items)
+    item->bbox = { item->bbox.minX * 3.4 - 170, item->bbox.minY * 1.6 - 80, item->bbox.maxX * 3.4 - 170, item->bbox.maxY * 1.6 - 80 };
+  loaded = items;
+  tree = new rbush::RBush<int>(loaded);
+  for (int q = 0; q < 50; q++)
+  {
+    double x = uniform(-180, 180);
+    double y = uniform(-80, 80);
+    double r = uniform(1e5, 3e6);
+    auto inRadius = toSet(tree->searchRadius(x, y, r, rbush::Metric::Haversine));
+    auto nearest = tree->nearest(x, y, rbush::Metric::Haversine);
+    double previous = 0;
+    bool ordered = true;
+    while (auto item = nearest.next())
+    {
+      ordered = ordered && nearest.distance() >= previous - 1e-6;
+      previous = nearest.distance();
+      if (previous > r * (1 + 1e-9))
+        break;
+      if (previous < r * (1 - 1e-9))
+        ordered = ordered && inRadius.count(item);
+    }
+    expect(ordered, "haversine nearest items by increasing distance, within searchRadius");
+  }
+  delete tree;
+  for (auto item: items)
+    delete item;
+
+  std::vector<Item *> none;
+  rbush::RBush<int> empty(none);
+  auto nearest = empty.nearest(0, 0);
+  expect(nearest.done() && !nearest.next(), "nearest of an empty tree");
+}
+
+// paged trees bulk loaded from a stream with little memory (many sorted runs, merged in several
+// passes, and slices sorted externally), searched, then reopened
+static void checkPagedRBush()
+{
+  typedef rbush::PagedRBush<int> Paged;
+  const std::string path = "rbush-check.idx";
+
+  for (int n: { 0, 1, 50, 30000 })
+  {
+    std::vector<Paged::Item> items;
+    for (int i = 0; i < n; i++)
+      items.push_back({ randomBbox(0, 100, 2), i });
+
+    for (std::size_t memoryItems: { std::size_t(6), std::size_t(1000), std::size_t(1) << 20 })
+    {
+      auto name = "paged tree of " + std::to_string(n) + " items in " + std::to_string(memoryItems);
+      std::size_t next = 0;
+      auto tree = Paged::create(path, [&items, &next](Paged::Item& item) -> bool
+      {
+        if (next == items.size())
+          return false;
+        item = items[next++];
+        return true;
+      }, 256, 8, memoryItems);
+      if (!tree)
+      {
+        expect(false, name + ": create");
+        continue;
+      }
+      delete tree;
+
+      tree = Paged::open(path, 4);
+      expect(tree && tree->size() == items.size(), name + ": open");
+      for (int q = 0; tree && q < 100; q++)
+      {
+        auto bbox = q ? randomBbox(-10, 110, 30) : rbush::Bbox{ -1, -1, 101, 101 };
+        std::multiset<int> found;
+        for (auto& item: items)
+          if (rbush::bboxIntersects(bbox, item.bbox))
+            found.insert(item.data);
+        auto result = tree->search(bbox);
+        expect(result && std::multiset<int>(result->begin(), result->end()) == found, name + ": search");
+        delete result;
+      }
+      delete tree;
+    }
+  }
+
+  expect(!rbush::PagedRBush<double>::open(path), "open of a paged tree of another payload");
+  std::remove(path.c_str());
+  expect(!Paged::open(path), "open of a missing file");
+}
+
+
+int main()
+{
+  struct
+  {
+    const char *name;
+    void (*run)();
+  } checks[] = {
+    { "remove and update", checkRemoveUpdate },
+    { "background rebuild", checkRebuild },
+    { "queries", checkQueries },
+    { "nearest", checkNearest },
+    { "paged tree", checkPagedRBush },
+  };
+
+  for (auto& check: checks)
+  {
+    int before = failures;
+    check.run();
+    std::cout << check.name << ": " << (failures == before ? "ok" : "FAILED") << "\n";
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+//
+// Node capacity tuning harness for RBush.
+//
+// Builds the tree for a dataset with a sweep of node capacities and build strategies
+// (OMT bulk load, one by one insertion), then measures build time and throughput, memory
+// used by the tree nodes, tree quality (expected nodes visited by a point query) and the
+// latency distribution of a query workload, and recommends the configuration with the
+// lowest median query latency.
+//
+// Usage: rbush-tune [-d data] [-q queries] [-n items] [-m queries] [-s size]
+//   -d data     GeoJSON file (bbox of each feature geometry) or CSV file of "minX,minY,maxX,maxY" or "x,y" lines;
+//               defaults to n random rectangles
+//   -q queries  CSV file of query boxes; defaults to m boxes of the given size centered on random items
+//   -n items    number of synthetic items (default 100000)
+//   -m queries  number of synthetic queries (default 10000)
+//   -s size     side of synthetic query boxes as a fraction of the data extent (default 0.01)
+//
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+
+#include <rapidjson/document.h>
+#include <rapidjson/filereadstream.h>
+
+#include "RBush.hpp"
+
+
+typedef rbush::TreeNode<int> Item;
+
+struct TuneResult
+{
+  int maxEntries;
+  const char *strategy;
+  double buildMs;
+  std::size_t memory;
+  double visited;
+  double p50;
+  double p90;
+  double p99;
+  double mean;
+  double results;
+};
+
+
+static void extendBbox(rbush::Bbox& bbox, const rapidjson::Value& coordinates)
+{
+  if (!coordinates.IsArray() || coordinates.Empty())
+    return;
+  if (coordinates[0].IsNumber())
+  {
+    double x = coordinates[0].GetDouble();
+    double y = coordinates.Size() > 1 ? coordinates[1].GetDouble() : 0;
+    rbush::bboxExtend(bbox, { x, y, x, y });
+    return;
+  }
+  for (auto& c: coordinates.GetArray())
+    extendBbox(bbox, c);
+}
+
+static void readGeoJson(const std::string& filename, std::vector<rbush::Bbox>& bboxes)
+{
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (!fp)
+  {
+    std::cerr << "Cannot open " << filename << "\n";
+    exit(1);
+  }
+  char readBuffer[65536];
+  rapidjson::FileReadStream is(fp, readBuffer, sizeof(readBuffer));
+  rapidjson::Document geojson;
+  geojson.ParseStream(is);
+  fclose(fp);
+  if (!geojson.IsObject() || !geojson.HasMember("features"))
+    return;
+  for (auto& feature: geojson["features"].GetArray())
+  {
+    if (!feature.HasMember("geometry") || !feature["geometry"].IsObject() || !feature["geometry"].HasMember("coordinates"))
+      continue;
+    auto bbox = rbush::emptyBbox();
+    extendBbox(bbox, feature["geometry"]["coordinates"]);
+    if (bbox.minX <= bbox.maxX)
+      bboxes.push_back(bbox);
+  }
+}
+
+static void readCsv(const std::string& filename, std::vector<rbush::Bbox>& bboxes)
+{
+  std::ifstream in(filename);
+  if (!in)
+  {
+    std::cerr << "Cannot open " << filename << "\n";
+    exit(1);
+  }
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::vector<double> values;
+    std::stringstream ss(line);
+    std::string field;
+    while (std::getline(ss, field, ','))
+      values.push_back(atof(field.c_str()));
+    if (values.size() >= 4)
+      bboxes.push_back({ values[0], values[1], values[2], values[3] });
+    else if (values.size() >= 2)
+      bboxes.push_back({ values[0], values[1], values[0], values[1] });
+  }
+}
+
+static void readBboxes(const std::string& filename, std::vector<rbush::Bbox>& bboxes)
+{
+  auto dot = filename.rfind('.');
+  auto ext = dot == std::string::npos ? std::string() : filename.substr(dot);
+  if (ext == ".json" || ext == ".geojson")
+    readGeoJson(filename, bboxes);
+  else
+    readCsv(filename, bboxes);
+}
+
+
+// memory used by the tree itself: nodes and child arrays, items excluded
+template <class T>
+static std::size_t treeMemory(const rbush::TreeBranch<T> *node)
+{
+  std::size_t memory = sizeof(*node) + sizeof(*node->children) + node->children->capacity() * sizeof(void *);
+  if (!node->leaf)
+    for (auto& child: *node->children)
+      memory += treeMemory<T>(rbush::asBranch(child));
+  return memory;
+}
+
+template <int MaxEntries>
+static TuneResult tune(std::vector<Item *>& items, const std::vector<rbush::Bbox>& queries, bool bulk)
+{
+  TuneResult result;
+  result.maxEntries = MaxEntries;
+  result.strategy = bulk ? "load" : "insert";
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<Item *> none;
+  auto tree = new rbush::RBush<int, MaxEntries>(bulk ? items : none);
+  if (!bulk)
+    for (auto& item: items)
+      tree->insert(item);
+  result.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  result.memory = treeMemory(tree->root());
+  result.visited = tree->quality().nodesVisited;
+
+  // one warm-up pass, then one timed pass
+  std::vector<double> latencies;
+  latencies.reserve(queries.size());
+  std::size_t found = 0;
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (auto& q: queries)
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      auto r = tree->search(q);
+      auto t1 = std::chrono::steady_clock::now();
+      if (pass)
+      {
+        latencies.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        found += r->size();
+      }
+      delete r;
+    }
+  }
+  delete tree;
+
+  std::sort(latencies.begin(), latencies.end());
+  double sum = 0;
+  for (auto l: latencies)
+    sum += l;
+  auto percentile = [&](double p) { return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, (std::size_t)(p * latencies.size()))]; };
+  result.p50 = percentile(0.5);
+  result.p90 = percentile(0.9);
+  result.p99 = percentile(0.99);
+  result.mean = latencies.empty() ? 0 : sum / latencies.size();
+  result.results = latencies.empty() ? 0 : (double)found / latencies.size();
+  return result;
+}
+
+template <int MaxEntries>
+static void sweep(std::vector<Item *>& items, const std::vector<rbush::Bbox>& queries, std::vector<TuneResult>& results)
+{
+  results.push_back(tune<MaxEntries>(items, queries, true));
+  results.push_back(tune<MaxEntries>(items, queries, false));
+}
+
+
+int main(int argc, char **argv)
+{
+  std::string dataFile;
+  std::string queryFile;
+  int n = 100000;
+  int m = 10000;
+  double size = 0.01;
+  for (int i = 1; i + 1 < argc; i += 2)
+  {
+    if (!strcmp(argv[i], "-d")) dataFile = argv[i + 1];
+    else if (!strcmp(argv[i], "-q")) queryFile = argv[i + 1];
+    else if (!strcmp(argv[i], "-n")) n = atoi(argv[i + 1]);
+    else if (!strcmp(argv[i], "-m")) m = atoi(argv[i + 1]);
+    else if (!strcmp(argv[i], "-s")) size = atof(argv[i + 1]);
+    else
+    {
+      std::cerr << "Usage: " << argv[0] << " [-d data] [-q queries] [-n items] [-m queries] [-s size]\n";
+      return 1;
+    }
+  }
+
+  std::mt19937 random(42);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  std::vector<rbush::Bbox> bboxes;
+  if (!dataFile.empty())
+    readBboxes(dataFile, bboxes);
+  else
+  {
+    for (int i = 0; i < n; i++)
+    {
+      double x = uniform(random) * 100;
+      double y = uniform(random) * 100;
+      bboxes.push_back({ x, y, x + uniform(random) * 0.1, y + uniform(random) * 0.1 });
+    }
+  }
+  if (bboxes.empty())
+  {
+    std::cerr << "No data\n";
+    return 1;
+  }
+
+  auto extent = rbush::emptyBbox();
+  for (auto& b: bboxes)
+  {
+    extent.minX = std::min(extent.minX, b.minX);
+    extent.minY = std::min(extent.minY, b.minY);
+    extent.maxX = std::max(extent.maxX, b.maxX);
+    extent.maxY = std::max(extent.maxY, b.maxY);
+  }
+
+  std::vector<rbush::Bbox> queries;
+  if (!queryFile.empty())
+    readBboxes(queryFile, queries);
+  else
+  {
+    double w = (extent.maxX - extent.minX) * size / 2;
+    double h = (extent.maxY - extent.minY) * size / 2;
+    for (int i = 0; i < m; i++)
+    {
+      auto& b = bboxes[random() % bboxes.size()];
+      double x = (b.minX + b.maxX) / 2;
+      double y = (b.minY + b.maxY) / 2;
+      queries.push_back({ x - w, y - h, x + w, y + h });
+    }
+  }
+
+  std::vector<Item> nodes(bboxes.size());
+  std::vector<Item *> items;
+  for (std::size_t i = 0; i < bboxes.size(); i++)
+  {
+    nodes[i].bbox = bboxes[i];
+    nodes[i].data = i;
+    items.push_back(&nodes[i]);
+  }
+
+  std::cout << bboxes.size() << " items, " << queries.size() << " queries\n\n";
+  std::cout << std::setw(10) << "capacity" << std::setw(9) << "build" << std::setw(12) << "build ms"
+            << std::setw(12) << "items/ms" << std::setw(12) << "memory KB" << std::setw(10) << "visited" << std::setw(10) << "p50 us" << std::setw(10) << "p90 us"
+            << std::setw(10) << "p99 us" << std::setw(10) << "mean us" << std::setw(10) << "results" << "\n";
+
+  std::vector<TuneResult> results;
+  sweep<4>(items, queries, results);
+  sweep<6>(items, queries, results);
+  sweep<8>(items, queries, results);
+  sweep<9>(items, queries, results);
+  sweep<12>(items, queries, results);
+  sweep<16>(items, queries, results);
+  sweep<24>(items, queries, results);
+  sweep<32>(items, queries, results);
+  sweep<48>(items, queries, results);
+  sweep<64>(items, queries, results);
+
+  const TuneResult *best = NULL;
+  for (auto& r: results)
+  {
+    std::cout << std::fixed << std::setprecision(2)
+              << std::setw(10) << r.maxEntries << std::setw(9) << r.strategy << std::setw(12) << r.buildMs
+              << std::setw(12) << items.size() / std::max(r.buildMs, 1e-3) << std::setw(12) << r.memory / 1024
+              << std::setw(10) << r.visited << std::setw(10) << r.p50 << std::setw(10) << r.p90
+              << std::setw(10) << r.p99 << std::setw(10) << r.mean << std::setw(10) << r.results << "\n";
+    // lowest median latency; break ties of less than 2% on memory
+    if (!best || r.p50 < best->p50 * 0.98 || (r.p50 <= best->p50 * 1.02 && r.memory < best->memory))
+      best = &r;
+  }
+
+  std::cout << "\nRecommended: rbush::RBush<T, " << best->maxEntries << "> built with "
+            << (strcmp(best->strategy, "load") ? "insert()" : "the constructor bulk load") << "\n";
+  return 0;
+}
@@ -13,19 +13,14 @@
 
 
 
-static rbush::TreeNode<TreeData> *treeItem(geojson::Polygon *polygon, std::map<std::string, std::string> *props)
+static rbush::TreeNode<TreeData> treeItem(geojson::Polygon *polygon, std::map<std::string, std::string> *props)
 {
-  auto item = new rbush::TreeNode<TreeData>();
-  item->bbox = { std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest() };
-  item->data = new TreeData({ polygon, props });
-  auto line = (*polygon)[0];
+  rbush::TreeNode<TreeData> item = rbush::TreeNode<TreeData>();
+  item.bbox = rbush::emptyBbox();
+  item.data = { polygon, props };
+  auto& line = (*polygon)[0];
   for (auto &p: line)
-  {
-    item->bbox.minX = std::min(item->bbox.minX, p.x);
-    item->bbox.minY = std::min(item->bbox.minY, p.y);
-    item->bbox.maxX = std::max(item->bbox.maxX, p.x);
-    item->bbox.maxY = std::max(item->bbox.maxY, p.y);
-  }
+    rbush::bboxExtend(item.bbox, { p.x, p.y, p.x, p.y });
   return item;
 }
 
@@ -67,9 +62,10 @@ static geojson::Properties *toProperties(rapidjson::Value& feature)
 }
 
 
-static rbush::RBush<TreeData> *buildIndex(rapidjson::Document& geojson, RunTimeStatistic& rts)
+// items are stored by value in one array, and the tree references them
+static rbush::RBush<TreeData> *buildIndex(rapidjson::Document& geojson, std::vector<rbush::TreeNode<TreeData>>& items, RunTimeStatistic& rts)
 {
-  std::vector<rbush::TreeNode<TreeData> *> bboxes;
+  items.clear();
 
   int index = 1;
   for (auto& feature: geojson["features"].GetArray())
@@ -83,18 +79,23 @@ static rbush::RBush<TreeData> *buildIndex(rapidjson::Document& geojson, RunTimeS
 
     if (type == "Polygon")
     {
-      bboxes.push_back(treeItem(toPolygon(geometry["coordinates"]), properties));
+      items.push_back(treeItem(toPolygon(geometry["coordinates"]), properties));
       rts++;
     }
     else if (type == "MultiPolygon")
     {
       for (auto& poly: geometry["coordinates"].GetArray())
       {
-        bboxes.push_back(treeItem(toPolygon(poly), properties));
+        items.push_back(treeItem(toPolygon(poly), properties));
         rts++;
       }
     }
   }
+
+  std::vector<rbush::TreeNode<TreeData> *> bboxes;
+  bboxes.reserve(items.size());
+  for (auto& item: items)
+    bboxes.push_back(&item);
   return new rbush::RBush<TreeData>(bboxes);
 }
 
@@ -108,7 +109,7 @@ WhichPolygon::WhichPolygon(std::string filename)
   rapidjson::Document geojson;
   geojson.ParseStream(is);
   fclose(fp);
-  m_tree = buildIndex(geojson, rts);
+  m_tree = buildIndex(geojson, m_items, rts);
 }
 
 WhichPolygon::WhichPolygon(const char *json)
@@ -116,7 +117,7 @@ WhichPolygon::WhichPolygon(const char *json)
   RunTimeStatistic rts("WhichPolygon", false);
   rapidjson::Document geojson;
   geojson.Parse(json);
-  m_tree = buildIndex(geojson, rts);
+  m_tree = buildIndex(geojson, m_items, rts);
 }
 
 WhichPolygon::~WhichPolygon()
@@ -126,11 +127,9 @@ WhichPolygon::~WhichPolygon()
 
 geojson::Properties *WhichPolygon::query(const geojson::Point& p)
 {
-  auto result = m_tree->search({ p.x, p.y, p.x, p.y });
-  for (auto& r: *result)
+  auto item = m_tree->findPoint(p.x, p.y, [&p](const rbush::TreeNode<TreeData> *r)
   {
-    if (r->data && pointIsInsidePolygon(*r->data->coords, p))
-      return r->data->props;
-  }
-  return NULL;
+    return r->data.coords && pointIsInsidePolygon(*r->data.coords, p);
+  });
+  return item ? item->data.props : NULL;
 }
@@ -2,6 +2,7 @@
 #define WHICHPOLYGON_HPP
 
 #include <string>
+#include <vector>
 
 #include "GeoJson.hpp"
 #include "RBush.hpp"
@@ -18,6 +19,7 @@ struct TreeData
 
 class WhichPolygon
 {
+  std::vector<rbush::TreeNode<TreeData>> m_items;
   rbush::RBush<TreeData> *m_tree;
 public:
   WhichPolygon(const char *json);
@@ -0,0 +1,22 @@
+##
+## Brute-force checks
+##
+## Release
+IntermediateDirectory  :=./Release
+OutputFile             :=$(IntermediateDirectory)/rbush-check
+IncludePath            :=-I.
+CXX      := /usr/bin/g++
+CXXFLAGS :=  -O2 -std=c++11 -Wall -pthread
+
+.PHONY: all run clean
+all: $(OutputFile)
+
+$(OutputFile): RBushCheck.cpp RBush.hpp PagedRBush.hpp
+	@test -d $(IntermediateDirectory) || mkdir -p $(IntermediateDirectory)
+	$(CXX) $(CXXFLAGS) $(IncludePath) RBushCheck.cpp -o $(OutputFile)
+
+run: $(OutputFile)
+	$(OutputFile)
+
+clean:
+	$(RM) $(OutputFile)
@@ -42,9 +42,42 @@ int main(int argc, char **argv)
     whichCountry(countryTree, y, x);
     rts++;
     //std::string country = whichCountry(countryTree, y, x);
-    //auto origin = (*(r->data->props))["ISO3166-1:alpha2"];
+    //auto origin = (*(r->data.props))["ISO3166-1:alpha2"];
     //std::cout << "Reverse geocode lon=" << y << ", lat=" << x << ": " << (country.empty() ? "not found" : country) << ", origin=" << origin << "\n";
   }
 
+  // Stabbing queries at random points of the data extent: generic search of a degenerate box
+  // against the point kernel of searchPoint
+  auto extent = countryTree->tree()->root()->bbox;
+  std::mt19937 random(42);
+  std::uniform_real_distribution<double> ux(extent.minX, extent.maxX), uy(extent.minY, extent.maxY);
+  std::vector<geojson::Point> points;
+  for (int i = 0; i < 1000000; i++)
+    points.push_back({ ux(random), uy(random) });
+
+  std::size_t found = 0;
+  {
+    RunTimeStatistic rts("Stabbing query, search({ x, y, x, y })", false);
+    for (auto& p: points)
+    {
+      auto r = countryTree->tree()->search({ p.x, p.y, p.x, p.y });
+      found += r->size();
+      delete r;
+      rts++;
+    }
+  }
+  {
+    RunTimeStatistic rts("Stabbing query, searchPoint(x, y)", false);
+    for (auto& p: points)
+    {
+      auto r = countryTree->tree()->searchPoint(p.x, p.y);
+      found -= r->size();
+      delete r;
+      rts++;
+    }
+  }
+  if (found)
+    std::cout << "searchPoint and search disagree\n";
+
 	return 0;
 }
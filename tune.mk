@@ -0,0 +1,19 @@
+##
+## Node capacity tuning harness
+##
+## Release
+IntermediateDirectory  :=./Release
+OutputFile             :=$(IntermediateDirectory)/rbush-tune
+IncludePath            :=-I. -I./lib -I./lib/rapidjson
+CXX      := /usr/bin/g++
+CXXFLAGS :=  -O2 -std=c++11 -Wall -DNDEBUG
+
+.PHONY: all clean
+all: $(OutputFile)
+
+$(OutputFile): RBushTune.cpp RBush.hpp
+	@test -d $(IntermediateDirectory) || mkdir -p $(IntermediateDirectory)
+	$(CXX) $(CXXFLAGS) $(IncludePath) RBushTune.cpp -o $(OutputFile)
+
+clean:
+	$(RM) $(OutputFile)